@@ -0,0 +1,233 @@
+/*
+host.c
+
+Stand-ins for the kernel calls, ACPI and the vendor database that pci.c
+uses, so the enumerator can run as an ordinary process on the simulated
+configuration space. Nothing here touches hardware: port I/O fails, there
+is no APIC and therefore no ACPI, and all configuration cycles go through
+pci_sim.c.
+*/
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "pci.h"
+
+int debug= 0;
+
+struct pci_isabridge pci_isabridge[]=
+{
+	{ 0x8086, 0x7000, 1, PCI_IB_PIIX, },	/* Intel 82371SB */
+	{ 0x1106, 0x0686, 1, PCI_IB_VIA, },	/* VIA VT82C686 */
+	{ 0x1022, 0x7410, 1, PCI_IB_AMD, },	/* AMD 766 */
+	{ 0x1039, 0x0008, 1, PCI_IB_SIS, },	/* SiS 85C503 */
+	{ 0x0000, 0x0000, 0, 0, },
+};
+
+/*===========================================================================*
+ *				panic					     *
+ *===========================================================================*/
+void panic(const char *fmt, ...)
+{
+	va_list ap;
+
+	fflush(stdout);
+	fprintf(stderr, "pcisim: panic: ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(2);
+}
+
+/*===========================================================================*
+ *				env_parse				     *
+ *===========================================================================*/
+int env_parse(const char *env, const char *fmt, int field, long *param,
+	long min, long max)
+{
+	/* Boot monitor variables are taken from the environment */
+	const char *s;
+	char *end;
+	long v;
+
+	(void)fmt;
+	(void)field;
+	if ((s = getenv(env)) == NULL)
+		return 0;
+	v = strtol(s, &end, 0);
+	if (*s == '\0' || *end != '\0' || v < min || v > max)
+		panic("bad value for %s: %s", env, s);
+	*param = v;
+	return 1;
+}
+
+/*===========================================================================*
+ *			kernel calls					     *
+ *===========================================================================*/
+int sys_getmachine(struct machine *mp)
+{
+	memset(mp, 0, sizeof(*mp));
+	return OK;
+}
+
+int sys_getkinfo(kinfo_t *kp)
+{
+	(void)kp;
+	return EPERM;
+}
+
+int sys_inb(int port, u32_t *value)
+{
+	(void)port;
+	*value = 0xff;
+	return EPERM;
+}
+
+int sys_inw(int port, u32_t *value)
+{
+	(void)port;
+	*value = 0xffff;
+	return EPERM;
+}
+
+int sys_inl(int port, u32_t *value)
+{
+	(void)port;
+	*value = 0xffffffff;
+	return EPERM;
+}
+
+int sys_outb(int port, u32_t value)
+{
+	(void)port;
+	(void)value;
+	return EPERM;
+}
+
+int sys_outw(int port, u32_t value)
+{
+	(void)port;
+	(void)value;
+	return EPERM;
+}
+
+int sys_outl(int port, u32_t value)
+{
+	(void)port;
+	(void)value;
+	return EPERM;
+}
+
+int sys_voutl(pvl_pair_t *pvl, int nr)
+{
+	(void)pvl;
+	(void)nr;
+	return EPERM;
+}
+
+int sys_privctl(endpoint_t proc, int req, void *p)
+{
+	(void)proc;
+	(void)req;
+	(void)p;
+	return OK;
+}
+
+int sys_safecopyfrom(endpoint_t src, cp_grant_id_t gid, vir_bytes off,
+	vir_bytes addr, size_t len)
+{
+	/* No RS: the process table is empty */
+	(void)src;
+	(void)gid;
+	(void)off;
+	memset((void *)addr, 0, len);
+	return OK;
+}
+
+void *vm_map_phys(endpoint_t who, void *phaddr, size_t len)
+{
+	(void)who;
+	(void)phaddr;
+	(void)len;
+	return MAP_FAILED;
+}
+
+void chardriver_announce(void)
+{
+}
+
+/*===========================================================================*
+ *				ACPI					     *
+ *===========================================================================*/
+int acpi_init(void)
+{
+	return ENOSYS;
+}
+
+int acpi_get_irq(unsigned bus, unsigned dev, unsigned pin)
+{
+	(void)bus;
+	(void)dev;
+	(void)pin;
+	return -1;
+}
+
+void acpi_map_bridge(unsigned pbus, unsigned pdev, unsigned sbus)
+{
+	(void)pbus;
+	(void)pdev;
+	(void)sbus;
+}
+
+/* Not in the stock ACPI server; only used when built with PCI_ECAM=1 */
+int acpi_get_mcfg(int idx, u64_t *basep, int *segp, int *startp, int *endp)
+{
+	(void)idx;
+	(void)basep;
+	(void)segp;
+	(void)startp;
+	(void)endp;
+	return ENOENT;
+}
+
+/* Not in the stock ACPI server either; only used with PCI_CRS=1 */
+int acpi_get_crs(int idx, int *iop, u64_t *basep, u64_t *sizep)
+{
+	(void)idx;
+	(void)iop;
+	(void)basep;
+	(void)sizep;
+	return ENOENT;
+}
+
+/*===========================================================================*
+ *			vendor and class names				     *
+ *===========================================================================*/
+int pci_findvendor(char *buf, size_t len, u16_t vid)
+{
+	/* No database; the IDs themselves keep the output deterministic */
+	snprintf(buf, len, "vendor %04x", vid);
+	return 0;
+}
+
+int pci_findproduct(char *buf, size_t len, u16_t vid, u16_t did)
+{
+	(void)vid;
+	snprintf(buf, len, "device %04x", did);
+	return 0;
+}
+
+const char *pci_baseclass_name(u32_t reg)
+{
+	(void)reg;
+	return NULL;
+}
+
+const char *pci_subclass_name(u32_t reg)
+{
+	(void)reg;
+	return NULL;
+}
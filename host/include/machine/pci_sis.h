@@ -0,0 +1 @@
+#include <pci_host.h>
@@ -0,0 +1,79 @@
+/*
+pci.h
+
+Host build stand-in for the driver's private header: the ISA bridge
+table, ACL slots and the _pci_* entry points the IPC layer calls.
+*/
+#ifndef PCI_H
+#define PCI_H
+
+#include <pci_host.h>
+
+struct pci_isabridge
+{
+	u16_t vid;
+	u16_t did;
+	int checkclass;
+	int type;
+};
+
+struct pci_acl
+{
+	int inuse;
+	struct rs_pci acl;
+};
+
+#define PCI_IB_PIIX	1	/* Intel PIIX compatible ISA bridge */
+#define PCI_IB_VIA	2	/* VIA compatible ISA bridge */
+#define PCI_IB_AMD	3	/* AMD compatible ISA bridge */
+#define PCI_IB_SIS	4	/* SIS compatible ISA bridge */
+
+#define PCI_PPB_STD	1	/* Standard PCI-to-PCI bridge */
+#define PCI_PPB_CB	2	/* Cardbus bridge */
+#define PCI_AGPB_VIA	3	/* VIA compatible AGP bridge */
+
+extern struct pci_isabridge pci_isabridge[];
+extern struct pci_acl pci_acl[NR_DRIVERS];
+extern int debug;
+
+int pci_findvendor(char *buf, size_t len, u16_t vid);
+int pci_findproduct(char *buf, size_t len, u16_t vid, u16_t did);
+
+int sef_cb_init(int type, sef_init_info_t *info);
+int map_service(struct rprocpub *rpub);
+
+int _pci_find_dev(u8_t bus, u8_t dev, u8_t func, int *devindp);
+int _pci_first_dev(struct rs_pci *aclp, int *devindp, u16_t *vidp,
+	u16_t *didp);
+int _pci_next_dev(struct rs_pci *aclp, int *devindp, u16_t *vidp,
+	u16_t *didp);
+int _pci_grant_access(int devind, endpoint_t proc);
+int _pci_reserve(int devind, endpoint_t proc, struct rs_pci *aclp);
+void _pci_release(endpoint_t proc);
+int _pci_ids(int devind, u16_t *vidp, u16_t *didp);
+void _pci_rescan_bus(u8_t busnr);
+int _pci_del_dev(int devind);
+int _pci_slot_name(int devind, char **cpp);
+const char *_pci_dev_name(u16_t vid, u16_t did);
+int _pci_get_bar64(int devind, int port, u64_t *base, u64_t *size,
+	int *ioflag);
+int _pci_get_bar(int devind, int port, u32_t *base, u32_t *size,
+	int *ioflag);
+int _pci_attr_r8(int devind, int port, u8_t *vp);
+int _pci_attr_r16(int devind, int port, u16_t *vp);
+int _pci_attr_r32(int devind, int port, u32_t *vp);
+int _pci_attr_w8(int devind, int port, u8_t value);
+int _pci_attr_w16(int devind, int port, u16_t value);
+int _pci_attr_w32(int devind, int port, u32_t value);
+int _pci_get_stats(int devind, unsigned long *readsp,
+	unsigned long *writesp);
+void _pci_dump_stats(void);
+
+int _pci_sim_init(const char *topology);
+int _pci_sim_slots(void);
+#ifdef PCI_BENCH
+#include <stdio.h>
+int _pci_bench(FILE *out);
+#endif
+
+#endif /* PCI_H */
@@ -0,0 +1,267 @@
+/*
+pci_host.h
+
+Just enough of the MINIX headers to build pci.c as an ordinary host
+process on top of the simulated configuration space (pci_sim.c). Every
+<minix/...>, <machine/...> and <dev/pci/...> header the driver includes
+resolves to this file; the kernel calls and ACPI functions it declares
+are stubs in host.c.
+*/
+#ifndef PCI_HOST_H
+#define PCI_HOST_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef uint8_t u8_t;
+typedef uint16_t u16_t;
+typedef uint32_t u32_t;
+typedef uint64_t u64_t;
+typedef int endpoint_t;
+typedef int cp_grant_id_t;
+typedef unsigned long phys_bytes;
+typedef unsigned long vir_bytes;
+
+#define OK		0
+#define TRUE		1
+#define FALSE		0
+#define SELF		0x8ace
+#define NONE		0x6ace
+#define RS_PROC_NR	2
+#define NR_BOOT_PROCS	32
+#define NR_DRIVERS	32
+#define PAGE_SIZE	4096
+
+#ifndef ESTALE
+#define ESTALE		116
+#endif
+
+/* <minix/syslib.h> */
+typedef struct { u16_t pr_port; u32_t pr_value; } pvl_pair_t;
+#define pv_set(pv, p, v) ((pv).pr_port = (p), (pv).pr_value = (v))
+
+typedef struct
+{
+	phys_bytes mem_high_phys;
+	int mmap_size;
+	struct { u64_t mm_base_addr, mm_length; } memmap[8];
+} kinfo_t;
+
+struct machine
+{
+	int apic_enabled;
+};
+
+struct io_range
+{
+	unsigned ior_base, ior_limit;
+};
+
+struct minix_mem_range
+{
+	phys_bytes mr_base, mr_limit;
+};
+
+#define SYS_PRIV_ADD_IO		1
+#define SYS_PRIV_ADD_MEM	2
+#define SYS_PRIV_ADD_IRQ	3
+
+/* <minix/rs.h> */
+#define RS_NR_PCI_DEVICE	32
+#define RS_NR_PCI_CLASS		4
+#define NO_VID			0xffff
+#define NO_SUB_VID		0xffff
+#define NO_SUB_DID		0xffff
+
+struct rs_pci_device
+{
+	u16_t vid, did, sub_vid, sub_did;
+};
+
+struct rs_pci_class
+{
+	u32_t pciclass, mask;
+};
+
+struct rs_pci
+{
+	char rsp_label[16];
+	int rsp_endpoint;
+	int rsp_nr_device;
+	struct rs_pci_device rsp_device[RS_NR_PCI_DEVICE];
+	int rsp_nr_class;
+	struct rs_pci_class rsp_class[RS_NR_PCI_CLASS];
+};
+
+struct rprocpub
+{
+	int in_use;
+	endpoint_t endpoint;
+	struct rs_pci pci_acl;
+};
+
+/* <minix/sef.h> */
+#define SEF_INIT_FRESH		0
+#define SEF_INIT_LU		1
+#define SEF_INIT_RESTART	2
+
+typedef struct
+{
+	cp_grant_id_t rproctab_gid;
+} sef_init_info_t;
+
+/* <machine/pci.h> */
+#define PCI_VID		0x00
+#define PCI_DID		0x02
+#define PCI_CR		0x04
+#define PCI_CR_IO_EN	0x0001
+#define PCI_CR_MEM_EN	0x0002
+#define PCI_CR_MAST_EN	0x0004
+#define PCI_SR		0x06
+#define PSR_CAPPTR	0x0010
+#define PSR_RTAS	0x1000
+#define PSR_RMAS	0x2000
+#define PSR_SSE		0x4000
+#define PCI_REV		0x08
+#define PCI_PIFR	0x09
+#define PCI_SCR		0x0a
+#define PCI_BCR		0x0b
+#define PCI_HEADT	0x0e
+#define PHT_MASK	0x7f
+#define PHT_NORMAL	0x00
+#define PHT_BRIDGE	0x01
+#define PHT_CARDBUS	0x02
+#define PHT_MULTIFUNC	0x80
+#define PCI_BAR		0x10
+#define PCI_BAR_IO	0x00000001
+#define PCI_BAR_TYPE	0x00000006
+#define PCI_TYPE_32	0x00000000
+#define PCI_TYPE_32_1M	0x00000002
+#define PCI_TYPE_64	0x00000004
+#define PCI_BAR_PREFETCH 0x00000008
+#define PCI_BAR_MEM_MASK 0xfffffff0
+#define PCI_BAR_IO_MASK	0xfffffffc
+#define PCI_BAR_2	0x14
+#define PCI_BAR_3	0x18
+#define PCI_BAR_4	0x1c
+#define PCI_BAR_5	0x20
+#define PCI_BAR_6	0x24
+#define PCI_SUBVID	0x2c
+#define PCI_SUBDID	0x2e
+#define PCI_CAPPTR	0x34
+#define PCI_CP_MASK	0xfc
+#define PCI_ILR		0x3c
+#define PCI_ILR_UNKNOWN	0xff
+#define PCI_IPR		0x3d
+
+#define CAP_TYPE	0
+#define CAP_NEXT	1
+
+#define PPB_PRIMBN	0x18
+#define PPB_SECBN	0x19
+#define PPB_SUBORDBN	0x1a
+#define PPB_SECBLT	0x1b
+#define PPB_IOBASE	0x1c
+#define PPB_IOB_MASK	0xf0
+#define PPB_IOLIMIT	0x1d
+#define PPB_IOL_MASK	0xf0
+#define PPB_SSTS	0x1e
+#define PPB_MEMBASE	0x20
+#define PPB_MEMB_MASK	0xfff0
+#define PPB_MEMLIMIT	0x22
+#define PPB_MEML_MASK	0xfff0
+#define PPB_PFMEMBASE	0x24
+#define PPB_PFMEMB_MASK	0xfff0
+#define PPB_PFMEMLIMIT	0x26
+#define PPB_PFMEML_MASK	0xfff0
+#define PPB_IOBASEU16	0x30
+#define PPB_IOLIMITU16	0x32
+#define PPB_BRIDGECTRL	0x3e
+
+#define CBB_SSTS	0x16
+#define CBB_MEMBASE_0	0x1c
+#define CBB_MEMLIMIT_0	0x20
+#define CBB_MEML_MASK	0xfffff000
+#define CBB_MEMBASE_1	0x24
+#define CBB_MEMLIMIT_1	0x28
+#define CBB_IOBASE_0	0x2c
+#define CBB_IOLIMIT_0	0x30
+#define CBB_IOL_MASK	0xfffffffc
+#define CBB_IOBASE_1	0x34
+#define CBB_IOLIMIT_1	0x38
+
+#define PCI_BCR_MASS_STORAGE	0x01
+#define PCI_MS_IDE		0x01
+#define PCI_IDE_PRI_NATIVE	0x01
+#define PCI_IDE_SEC_NATIVE	0x04
+#define PCI_T3_ISA		0x060100
+#define PCI_T3_PCI2PCI		0x060400
+#define PCI_T3_PCI2PCI_SUBTR	0x060401
+#define PCI_T3_CARDBUS		0x060700
+
+/* <machine/pci_intel.h> */
+#define PCII_CONFADD	0xcf8
+#define PCII_CONFDATA	0xcfc
+#define PCII_UNSEL	0
+#define PCII_SELREG_(bus, dev, func, reg) \
+	(0x80000000 | ((bus) << 16) | ((dev) << 11) | ((func) << 8) | \
+	((reg) & 0xfc))
+#define PCII_RREG16_(bus, dev, func, reg) \
+	(pci_outl(PCII_CONFADD, PCII_SELREG_(bus, dev, func, reg)), \
+	pci_inw(PCII_CONFDATA + ((reg) & 2)))
+
+#define PIIX_ELCR1	0x4d0
+#define PIIX_ELCR2	0x4d1
+#define PIIX_PIRQRCA	0x60
+#define PIIX_IRQ_DI	0x80
+#define PIIX_IRQ_MASK	0x0f
+
+/* <machine/pci_amd.h>, <machine/pci_sis.h>, <machine/pci_via.h> */
+#define AMD_ISABR_FUNC		3
+#define AMD_ISABR_PCIIRQ_LEV	0x54
+#define AMD_ISABR_PCIIRQ_ROUTE	0x56
+#define SIS_ISABR_IRQ_A		0x41
+#define SIS_IRQ_DISABLED	0x80
+#define SIS_IRQ_MASK		0x0f
+#define VIA_ISABR_EL		0x54
+#define VIA_ISABR_EL_INTA	0x08
+#define VIA_ISABR_EL_INTB	0x04
+#define VIA_ISABR_EL_INTC	0x02
+#define VIA_ISABR_EL_INTD	0x01
+#define VIA_ISABR_IRQ_R1	0x55
+#define VIA_ISABR_IRQ_R2	0x56
+#define VIA_ISABR_IRQ_R3	0x57
+
+/* Kernel calls, ACPI and the rest, see host.c */
+void panic(const char *fmt, ...) __attribute__((noreturn));
+int env_parse(const char *env, const char *fmt, int field, long *param,
+	long min, long max);
+int sys_getmachine(struct machine *mp);
+int sys_getkinfo(kinfo_t *kp);
+int sys_inb(int port, u32_t *value);
+int sys_inw(int port, u32_t *value);
+int sys_inl(int port, u32_t *value);
+int sys_outb(int port, u32_t value);
+int sys_outw(int port, u32_t value);
+int sys_outl(int port, u32_t value);
+int sys_voutl(pvl_pair_t *pvl, int nr);
+int sys_privctl(endpoint_t proc, int req, void *p);
+int sys_safecopyfrom(endpoint_t src, cp_grant_id_t gid, vir_bytes off,
+	vir_bytes addr, size_t len);
+void *vm_map_phys(endpoint_t who, void *phaddr, size_t len);
+void chardriver_announce(void);
+
+int acpi_init(void);
+int acpi_get_irq(unsigned bus, unsigned dev, unsigned pin);
+void acpi_map_bridge(unsigned pbus, unsigned pdev, unsigned sbus);
+int acpi_get_mcfg(int idx, u64_t *basep, int *segp, int *startp,
+	int *endp);
+int acpi_get_crs(int idx, int *iop, u64_t *basep, u64_t *sizep);
+
+/* <dev/pci/pci_verbose.h> */
+const char *pci_baseclass_name(u32_t reg);
+const char *pci_subclass_name(u32_t reg);
+
+#endif /* PCI_HOST_H */
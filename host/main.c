@@ -0,0 +1,294 @@
+/*
+main.c
+
+pcisim: enumerate a simulated topology with the real driver code and
+print what a driver would see through the _pci_* interface, one block per
+device, in devind order, followed by the size of the device table. Lookups
+through _pci_find_dev and _pci_query_dev are checked against that list
+and only disagreements are printed. The output only depends on the
+topology, so the tests in tests/ compare it against a stored copy.
+
+	pcisim [-ds] <topology> [<bus> <topology> ...]
+	pcisim -b
+
+Each further <bus> <topology> pair is a hot-plug event: the simulated
+machine changes to the new topology, functions with unchanged IDs
+keeping their state, and bus <bus> is rescanned and dumped again. -b
+runs the benchmarks and writes CSV to stdout. -s prints the
+configuration access counters at the end; build with
+CFLAGS+=-DPCI_STATS=1 to have any.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pci.h"
+#include "pci_query.h"
+#include "pci_sim.h"
+
+#define PPB_PFBASE_HI	0x28	/* upper halves of a 64-bit prefetchable window */
+#define PPB_PFLIMIT_HI	0x2c
+
+static void dump_windows(int devind)
+{
+	u8_t io_base, io_limit;
+	u16_t io_base_hi, io_limit_hi, m_base, m_limit, pf_base, pf_limit;
+	u32_t pf_base_hi, pf_limit_hi;
+	u64_t base, limit;
+
+	/* Decode the windows as the bridge does; a window is closed when
+	 * its limit is below its base.
+	 */
+	_pci_attr_r8(devind, PPB_IOBASE, &io_base);
+	_pci_attr_r8(devind, PPB_IOLIMIT, &io_limit);
+	_pci_attr_r16(devind, PPB_IOBASEU16, &io_base_hi);
+	_pci_attr_r16(devind, PPB_IOLIMITU16, &io_limit_hi);
+	base = (io_base & PPB_IOB_MASK) << 8;
+	limit = ((io_limit & PPB_IOL_MASK) << 8) | 0xfff;
+	if ((io_base & ~PPB_IOB_MASK) == 1) {
+		base |= (u32_t)io_base_hi << 16;
+		limit |= (u32_t)io_limit_hi << 16;
+	}
+	if (limit < base)
+		printf("\tio\tclosed\n");
+	else {
+		printf("\tio\t0x%llx-0x%llx\n", (unsigned long long)base,
+			(unsigned long long)limit);
+	}
+
+	_pci_attr_r16(devind, PPB_MEMBASE, &m_base);
+	_pci_attr_r16(devind, PPB_MEMLIMIT, &m_limit);
+	base = (u64_t)(m_base & PPB_MEMB_MASK) << 16;
+	limit = ((u64_t)(m_limit & PPB_MEML_MASK) << 16) | 0xfffff;
+	if (limit < base)
+		printf("\tmem\tclosed\n");
+	else {
+		printf("\tmem\t0x%llx-0x%llx\n", (unsigned long long)base,
+			(unsigned long long)limit);
+	}
+
+	_pci_attr_r16(devind, PPB_PFMEMBASE, &pf_base);
+	_pci_attr_r16(devind, PPB_PFMEMLIMIT, &pf_limit);
+	base = (u64_t)(pf_base & PPB_PFMEMB_MASK) << 16;
+	limit = ((u64_t)(pf_limit & PPB_PFMEML_MASK) << 16) | 0xfffff;
+	if ((pf_base & ~PPB_PFMEMB_MASK) == 1) {
+		_pci_attr_r32(devind, PPB_PFBASE_HI, &pf_base_hi);
+		_pci_attr_r32(devind, PPB_PFLIMIT_HI, &pf_limit_hi);
+		base |= (u64_t)pf_base_hi << 32;
+		limit |= (u64_t)pf_limit_hi << 32;
+	}
+	if (limit < base)
+		printf("\tpfmem\tclosed\n");
+	else {
+		printf("\tpfmem\t0x%llx-0x%llx\n", (unsigned long long)base,
+			(unsigned long long)limit);
+	}
+}
+
+static void dump_dev(int devind, const char *name)
+{
+	u8_t headt, pifr, scr, bcr, prim, sec, subord;
+	u16_t vid, did;
+	u64_t base, size;
+	int port, ioflag, r;
+
+	_pci_ids(devind, &vid, &did);
+	_pci_attr_r8(devind, PCI_BCR, &bcr);
+	_pci_attr_r8(devind, PCI_SCR, &scr);
+	_pci_attr_r8(devind, PCI_PIFR, &pifr);
+	_pci_attr_r8(devind, PCI_HEADT, &headt);
+	printf("%d\t%s\t%04x:%04x\tclass %02x%02x%02x\n", devind, name, vid, did,
+		bcr, scr, pifr);
+
+	for (port = PCI_BAR; port <= PCI_BAR_6; port += 4) {
+		r = _pci_get_bar64(devind, port, &base, &size, &ioflag);
+		if (r != OK)
+			continue;
+		printf("\tbar 0x%02x\t%s\t0x%llx/0x%llx\n", port,
+			ioflag ? "io" : "mem", (unsigned long long)base,
+			(unsigned long long)size);
+	}
+
+	switch (headt & PHT_MASK) {
+	case PHT_BRIDGE:
+	case PHT_CARDBUS:
+		_pci_attr_r8(devind, PPB_PRIMBN, &prim);
+		_pci_attr_r8(devind, PPB_SECBN, &sec);
+		_pci_attr_r8(devind, PPB_SUBORDBN, &subord);
+		printf("\tbus\t%d %d-%d\n", prim, sec, subord);
+		if ((headt & PHT_MASK) == PHT_BRIDGE)
+			dump_windows(devind);
+		break;
+	}
+}
+
+static void check_query(const struct pci_dev_ent *ents, int n, u16_t vid,
+	u16_t did, u32_t class, u32_t mask)
+{
+	struct pci_query q;
+	int i, want, got;
+
+	/* _pci_query_dev takes a different path for a vendor, a class
+	 * range and any other class mask; all must agree with a plain
+	 * comparison against the list of every device.
+	 */
+	for (i = want = 0; i < n; i++) {
+		if ((vid == PCI_QUERY_ANY || ents[i].pde_vid == vid) &&
+			(did == PCI_QUERY_ANY || ents[i].pde_did == did) &&
+			((ents[i].pde_class ^ class) & mask & 0xffffff) == 0)
+			want++;
+	}
+
+	q.pq_vid = vid;
+	q.pq_did = did;
+	q.pq_sub_vid = PCI_QUERY_ANY;
+	q.pq_sub_did = PCI_QUERY_ANY;
+	q.pq_class = class;
+	q.pq_class_mask = mask;
+	if (_pci_query_dev(NULL, &q, NULL, 0, &got) != OK)
+		got = -1;
+	if (got != want) {
+		printf("\tquery %04x:%04x class 0x%x/0x%x: %d found, %d expected\n",
+			vid, did, class, mask, got, want);
+	}
+}
+
+static void check_queries(const struct pci_dev_ent *ents, int n)
+{
+	u32_t class;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (i > 0 && ents[i].pde_vid == ents[i - 1].pde_vid &&
+			ents[i].pde_did == ents[i - 1].pde_did &&
+			ents[i].pde_class == ents[i - 1].pde_class)
+			continue;
+
+		/* Bits above the class must not matter */
+		class = ents[i].pde_class | 0xff000000;
+		check_query(ents, n, ents[i].pde_vid, ents[i].pde_did, 0, 0);
+		check_query(ents, n, ents[i].pde_vid, PCI_QUERY_ANY, class,
+			0xffffffff);
+		check_query(ents, n, PCI_QUERY_ANY, PCI_QUERY_ANY, class,
+			0xffffffff);
+		check_query(ents, n, PCI_QUERY_ANY, PCI_QUERY_ANY, class,
+			0xffff0000);
+		check_query(ents, n, PCI_QUERY_ANY, PCI_QUERY_ANY, class,
+			0xff00ff00);
+	}
+}
+
+static void dump(void)
+{
+	static const struct pci_query all = { PCI_QUERY_ANY, PCI_QUERY_ANY,
+		PCI_QUERY_ANY, PCI_QUERY_ANY, 0, 0 };
+	static struct pci_dev_ent *prev;
+	static int nprev;
+	struct pci_dev_ent *ents;
+	char *name;
+	unsigned busnr, dev, func;
+	u16_t vid, did;
+	int i, j, n, found;
+
+	/* Every device, in devind order, the way a driver without an ACL
+	 * would find them.
+	 */
+	if (_pci_query_dev(NULL, &all, NULL, 0, &n) != OK)
+		exit(1);
+	if ((ents = malloc((n + 1) * sizeof(*ents))) == NULL ||
+		_pci_query_dev(NULL, &all, ents, n, &n) != OK)
+		exit(1);
+
+	for (i = 0; i < n; i++) {
+		if (_pci_slot_name(ents[i].pde_devind, &name) != OK) {
+			printf("%d\tno slot name\n", ents[i].pde_devind);
+			continue;
+		}
+		dump_dev(ents[i].pde_devind, name);
+
+		/* The BDF index must lead back to the same entry */
+		if (sscanf(name, "%*d.%u.%u.%u", &busnr, &dev, &func) != 3 ||
+			!_pci_find_dev(busnr, dev, func, &found) ||
+			found != ents[i].pde_devind) {
+			printf("\tnot found by _pci_find_dev\n");
+		}
+	}
+
+	check_queries(ents, n);
+
+	/* A devind from the previous dump that is not in this one belongs
+	 * to a removed device, even if its slot has been reused.
+	 */
+	for (i = 0; i < nprev; i++) {
+		for (j = 0; j < n; j++) {
+			if (ents[j].pde_devind == prev[i].pde_devind)
+				break;
+		}
+		if (j == n && _pci_ids(prev[i].pde_devind, &vid, &did) != ENODEV)
+			printf("%d\tstill valid after removal\n", prev[i].pde_devind);
+	}
+	free(prev);
+	prev = ents;
+	nprev = n;
+
+	/* Removed devices leave their slot to the next new one, so this
+	 * only grows with the number of devices present at once.
+	 */
+	printf("table\t%d slots\n", _pci_sim_slots());
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: pcisim [-ds] <topology> [<bus> <topology> ...]\n"
+		"       pcisim -b\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i, busnr, bench = 0, stats = 0;
+
+	while ((c = getopt(argc, argv, "bds")) != -1) {
+		switch (c) {
+		case 'b':
+			bench = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 's':
+			stats = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (bench) {
+		if (argc != 0)
+			usage();
+		return _pci_bench(stdout) == OK ? 0 : 1;
+	}
+
+	if (argc < 1 || argc % 2 != 1)
+		usage();
+	if (_pci_sim_init(argv[0]) != OK)
+		return 1;
+	dump();
+
+	for (i = 1; i < argc; i += 2) {
+		busnr = atoi(argv[i]);
+		if (pcisim_update(argv[i + 1]) != 0)
+			return 1;
+		printf("rescan %d\n", busnr);
+		_pci_rescan_bus(busnr);
+		dump();
+	}
+
+	if (stats)
+		_pci_dump_stats();
+	return 0;
+}
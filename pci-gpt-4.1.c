@@ -10,6 +10,7 @@ Created:	Jan 2000 by Philip Homburg <philip@cs.vu.nl>
 #include <minix/driver.h>
 #include <minix/param.h>
 #include <minix/rs.h>
+#include <minix/vm.h>
 
 #include <machine/pci.h>
 #include <machine/pci_amd.h>
@@ -21,10 +22,21 @@ Created:	Jan 2000 by Philip Homburg <philip@cs.vu.nl>
 #include <dev/pci/pci_verbose.h>
 
 #include <pci.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <stdio.h>
+#include <sys/mman.h>
 
 #include "pci.h"
+#include "pci_query.h"
+#ifdef PCI_SIM
+#include "pci_sim.h"
+#endif
+#ifdef PCI_BENCH
+#include <time.h>
+#endif
 
 #define PCI_VENDORSTR_LEN	64
 #define PCI_PRODUCTSTR_LEN	64
@@ -34,11 +46,122 @@ Created:	Jan 2000 by Philip Homburg <philip@cs.vu.nl>
 #define PBT_INTEL_HOST	 1
 #define PBT_PCIBRIDGE	 2
 #define PBT_CARDBUS	 3
+#define PBT_GONE	 4	/* bridge removed, entry no longer used */
+
+/* pb_probe */
+#define PBP_DEV0	1	/* point-to-point link, only device 0 */
+#define PBP_ARI		2	/* bridge can forward ARI function numbers */
+
+/* Bridge windows, index into pb_win */
+#define PBW_IO		0
+#define PBW_MEM		1
+#define PBW_PFMEM	2	/* prefetchable memory */
+#define PBW_NR		3
+
+/* pw_flags */
+#define PWF_PRESENT	1	/* the bridge implements this window */
+#define PWF_64		2	/* window can be placed above 4 GB */
+#define PWF_SEEDED	4	/* assigned; pw_free describes it */
+#define PWF_LOW		8	/* holds 32-bit BARs, must stay below 4 GB */
+
+#define PPB_PFBASE_HI	0x28	/* upper halves of a 64-bit prefetchable window */
+#define PPB_PFLIMIT_HI	0x2c
+#define PPB_IO_GRAN	0x1000	/* window granularity of PCI-to-PCI bridges */
+#define PPB_MEM_GRAN	0x100000
+#define CBB_IO_GRAN	4	/* and of CardBus bridges */
+#define CBB_MEM_GRAN	0x1000
+#define CBB_IO_MIN	0x100	/* kept behind a CardBus bridge for cards */
+#define CBB_MEM_MIN	0x400000	/* inserted later */
+
+#define PCI_HP_SPARE	8	/* bus numbers kept behind a hot-plug port */
+#define CBB_SPARE	3	/* and behind a CardBus bridge */
 
 #define BAM_NR		6	/* Number of base-address registers */
 
+/* ECAM regions come from the ACPI MCFG table, and only the ACPI server
+ * can read that. The stock ACPI server has no request for it, so ECAM is
+ * compiled in only with PCI_ECAM=1, for an ACPI server and libsys that
+ * provide acpi_get_mcfg. Otherwise all buses use CF8/CFC.
+ */
+#ifndef PCI_ECAM
+#define PCI_ECAM	0
+#endif
+
+/* Likewise, the host bridge windows come from its _CRS, and the stock ACPI
+ * server cannot evaluate that for us. With PCI_CRS=1 they are taken from
+ * acpi_get_crs; otherwise ra_seed uses the fixed windows.
+ */
+#ifndef PCI_CRS
+#define PCI_CRS		0
+#endif
+
+#define NR_ECAM		4	/* Number of MCFG (ECAM) regions we map */
+#define ECAM_BUS_SHIFT	20	/* 1 MB of configuration space per bus */
+#define ECAM_OFF(dev, func, port) \
+	(((dev) << 15) | ((func) << 12) | (port))
+
+/* PCI Express capability, see pcie_link_probe */
+#define PCI_CAP_PCIE	0x10	/* Capability ID */
+#define PCIE_CAPREG	0x02	/* PCI Express capabilities register */
+#define PCIE_CAP_TYPE(v) (((v) >> 4) & 0xf)	/* Device/port type */
+#define PCIE_TYPE_ROOT	0x4	/* Root port */
+#define PCIE_TYPE_DOWN	0x6	/* Switch downstream port */
+#define PCIE_CAP_SLOT	0x100	/* Slot implemented */
+#define PCIE_SLOTCAP	0x14
+#define PCIE_SLOTCAP_HPC 0x40	/* Hot-plug capable */
+#define PCIE_DEVCAP2	0x24
+#define PCIE_DEVCAP2_ARI 0x20	/* ARI forwarding supported */
+#define PCIE_DEVCTL2	0x28
+#define PCIE_DEVCTL2_ARI 0x20	/* ARI forwarding enable */
+#define PCI_ECAP_ARI	0x000e	/* ARI extended capability ID */
+#define PCI_ARI_CAP	0x04	/* ARI capability register */
+
+#define PCII_BATCH_MAX	32	/* config writes queued per sys_voutl call */
+
+#define PCI_CFG_SIZE	256	/* Conventional configuration space */
+#define PCI_EXT_CFG_SIZE 4096	/* PCIe extended configuration space */
+
+/* Configuration access counters. Build with PCI_STATS=1 to enable them;
+ * otherwise the STAT_* hooks compile to nothing. They are a debugging aid
+ * only: no request of the IPC interface reads them. With pci_debug set
+ * they are printed after enumeration, and _pci_get_stats/_pci_dump_stats
+ * can be called from a debugger or the host harness.
+ */
+#ifndef PCI_STATS
+#define PCI_STATS	0
+#endif
+
+#define PCI_SHADOW_SIZE	256	/* Bytes of config space shadowed per device */
+#define SHADOW_DW(reg)	((u64_t)1 << ((reg) >> 2))
+
+/* Dwords that are cacheable before the header type is known. */
+#define SHADOW_PROBE	(SHADOW_DW(PCI_VID) | SHADOW_DW(PCI_REV) | \
+			 SHADOW_DW(PCI_HEADT))
+
 struct pci_acl pci_acl[NR_DRIVERS];
 
+/* A set of free address ranges, see ra_reserve and friends */
+struct res_range
+{
+	u64_t rr_base;
+	u64_t rr_size;
+};
+
+struct res_alloc
+{
+	struct res_range *ra_range;
+	int ra_nr;
+	int ra_alloc;
+};
+
+#if PCI_STATS
+struct pci_stat
+{
+	unsigned long ps_reads;
+	unsigned long ps_writes;
+};
+#endif
+
 static struct pcibus
 {
 	int pb_type;
@@ -47,7 +170,32 @@ static struct pcibus
 	int pb_isabridge_type;
 
 	int pb_devind;
+	int pb_segment;
 	int pb_busnr;
+	int pb_subord;		/* Highest bus number behind this bus */
+	struct res_alloc pb_busfree;	/* Unused numbers in (busnr, subord] */
+	volatile u8_t *pb_ecam;	/* ECAM window of this bus, or NULL */
+	int pb_cfgsize;		/* Config space reachable by the accessors */
+	int pb_pciecap;		/* PCIe capability of the bridge, or 0 */
+	int pb_probe;		/* PBP_* probe restrictions */
+	int pb_first_dev;	/* Devices on this bus, linked by pd_next */
+	int pb_last_dev;
+
+	/* Address windows the bridge forwards to this bus, by PBW_*. The
+	 * host bus has none; its space is ra_mem and ra_io.
+	 */
+	struct pci_win
+	{
+		int pw_flags;		/* PWF_* */
+		u64_t pw_base;
+		u64_t pw_size;		/* 0 while not assigned */
+		u64_t pw_need;		/* space required below, see win_size */
+		u64_t pw_align;
+		struct res_alloc pw_free;	/* unused part of the window */
+	} pb_win[PBW_NR];
+#if PCI_STATS
+	struct pci_stat pb_stat;
+#endif
 	u8_t (*pb_rreg8)(int busind, int devind, int port);
 	u16_t (*pb_rreg16)(int busind, int devind, int port);
 	u32_t (*pb_rreg32)(int busind, int devind, int port);
@@ -56,22 +204,82 @@ static struct pcibus
 	void (*pb_wreg32)(int busind, int devind, int port, u32_t value);
 	u16_t (*pb_rsts)(int busind);
 	void (*pb_wsts)(int busind, u16_t value);
-} pcibus[NR_PCIBUS];
-static int nr_pcibus= 0;
+} *pcibus;
+static int nr_pcibus= 0, pcibus_alloc= 0;
+
+/* Bus number to pcibus[] index plus one; 0 means no such bus. Updated by
+ * pci_set_busnr.
+ */
+static short pci_busmap[256];
+
+/* Memory-mapped configuration space regions, taken from the ACPI MCFG
+ * table. Buses covered by one of these are accessed with plain loads and
+ * stores; all other buses use the CF8/CFC mechanism.
+ */
+static struct pcie_ecam
+{
+	int pe_segment;
+	int pe_startbus;
+	int pe_endbus;
+	u64_t pe_base;
+	volatile u8_t *pe_vaddr;
+} pcie_ecam[NR_ECAM];
+static int nr_ecam= 0;
+static int use_ecam= 1;
+
+/* Queued CF8/CFC configuration writes. Between pci_batch_begin() and
+ * pci_batch_end(), 32-bit writes are collected as (address, data) port
+ * pairs and issued with a single vectored sys_voutl call. Any other CF8/CFC
+ * access flushes the queue first, so ordering is preserved.
+ */
+static pvl_pair_t pcii_batch[2 * PCII_BATCH_MAX];
+static int pcii_batch_nr= 0;
+static int pcii_batching= 0;
+
+/* What is currently latched in PCII_CONFADD. Consecutive accesses to the
+ * same dword skip the address write, and the unselect is only written at
+ * serialization points (see pcii_unselect).
+ */
+static u32_t pcii_latched= PCII_UNSEL;
+static struct
+{
+	unsigned long pls_accesses;
+	unsigned long pls_sel_written;
+	unsigned long pls_sel_elided;
+	unsigned long pls_unsel_written;
+	unsigned long pls_unsel_elided;
+} pcii_latch_stats;
+
+/* Per device state is split in two tables indexed by devind. pciid[]
+ * holds what lookups and ACL matching scan: 16-byte identity and class
+ * records, four to a cache line. Everything else lives in pcidev[].
+ */
+static struct pciid
+{
+	u8_t pi_busnr;
+	u8_t pi_dev;
+	u8_t pi_func;
+	u8_t pi_headt;
+	u8_t pi_baseclass;
+	u8_t pi_subclass;
+	u8_t pi_infclass;
+	u8_t pi_flags;		/* PIF_* */
+	u16_t pi_vid;
+	u16_t pi_did;
+	u16_t pi_sub_vid;
+	u16_t pi_sub_did;
+} *pciid;
+
+/* pi_flags */
+#define PIF_GONE	1	/* removed; the slot is on the free list */
+#define PIF_NEW		2	/* probed, not yet seen by complete_bars */
 
 static struct pcidev
 {
-	u8_t pd_busnr;
-	u8_t pd_dev;
-	u8_t pd_func;
-	u8_t pd_baseclass;
-	u8_t pd_subclass;
-	u8_t pd_infclass;
-	u16_t pd_vid;
-	u16_t pd_did;
-	u16_t pd_sub_vid;
-	u16_t pd_sub_did;
 	u8_t pd_ilr;
+	int pd_busind;		/* pcibus[] entry of pi_busnr */
+	int pd_next;		/* Next device on the same bus, or -1 */
+	u16_t pd_tag;		/* Bumped when the slot is freed */
 
 	u8_t pd_inuse;
 	endpoint_t pd_proc;
@@ -80,26 +288,546 @@ static struct pcidev
 	{
 		int pb_flags;
 		int pb_nr;
-		u32_t pb_base;
-		u32_t pb_size;
+		u64_t pb_base;
+		u64_t pb_size;
 	} pd_bar[BAM_NR];
 	int pd_bar_nr;
-} pcidev[NR_PCIDEV];
+
+	/* Shadow of the configuration header. Only dwords in pd_shadow_ok
+	 * are ever served from memory; the command/status register, the
+	 * secondary status and bridge control registers and the whole
+	 * capability area are volatile and always read from hardware.
+	 */
+	u64_t pd_shadow_ok;
+	u64_t pd_shadow_valid;
+	u32_t pd_shadow[PCI_SHADOW_SIZE / 4];
+#if PCI_STATS
+	struct pci_stat pd_stat;
+#endif
+} *pcidev;
+
+/* An incomplete BAR or unassigned bridge window waiting for complete_bars */
+struct bar_req
+{
+	int br_busind;		/* bus whose space it is taken from */
+	int br_win;		/* PBW_* window of that bus */
+	int br_devind;		/* device of the BAR, or -1 for a window */
+	int br_bar;		/* index in pd_bar, or PBW_* of br_child */
+	int br_child;		/* bus behind the window */
+	u64_t br_size;
+	u64_t br_align;
+	u64_t br_limit;		/* must end below this address */
+};
 
 /* pb_flags */
 #define PBF_IO		1	/* I/O else memory */
 #define PBF_INCOMPLETE	2	/* not allocated */
+#define PBF_64		4	/* 64-bit memory BAR, uses two registers */
+#define PBF_PREFETCH	8	/* prefetchable memory BAR */
+
+static int nr_pcidev= 0, pcidev_alloc= 0;
+
+/* pcidev[] and pcibus[] start empty and grow by doubling, starting at
+ * PCI_DEV_CHUNK and PCI_BUS_CHUNK entries. Devices and buses are always
+ * referred to by index, so entries keep their devind/busind when a table
+ * moves; don't hold a pointer into a table across pci_reserve_*.
+ */
+#define PCI_DEV_CHUNK	32
+#define PCI_BUS_CHUNK	8
+
+/* The devind handed to drivers is the pcidev[] slot with the slot's
+ * pd_tag in the bits above it. pci_del_dev bumps the tag and puts the
+ * slot on pci_free_dev, linked through pd_next, and probe_func takes
+ * slots from there before growing the table. A devind kept across the
+ * removal no longer matches the tag and gets ENODEV, until the tag
+ * wraps after PCI_TAG_MASK + 1 reuses of the slot.
+ */
+#define PCI_SLOT_BITS	17
+#define PCI_DEV_MAX	(1 << PCI_SLOT_BITS)
+#define PCI_TAG_MASK	((1 << (31 - PCI_SLOT_BITS)) - 1)
+#define PCI_SLOT(devind)	((devind) & (PCI_DEV_MAX - 1))
+#define PCI_TAG(devind)		((devind) >> PCI_SLOT_BITS)
+
+static int pci_free_dev= -1;
+
+/* Bus/device/function to devind index. One table of 256 entries per bus
+ * number, indexed by (dev << 3) | func and allocated when the first
+ * function on that bus is added. Unused entries are -1.
+ */
+#define PCI_DEVFN(dev, func)	(((dev) << 3) | (func))
+static int *pci_bdf_index[256];
+
+/* Incremented whenever devices are added to or removed from the tables;
+ * anything derived from the device list is stale when this changes.
+ */
+static unsigned int pci_generation= 1;
+
+/*===========================================================================*
+ *				pci_reserve_dev				     *
+ *===========================================================================*/
+static void pci_reserve_dev(int devind)
+{
+	struct pcidev *tab;
+	struct pciid *idtab;
+	int alloc;
+
+	/* Make sure pcidev[devind] exists. */
+	if (devind < pcidev_alloc)
+		return;
+
+	alloc = pcidev_alloc ? pcidev_alloc : PCI_DEV_CHUNK;
+	while (alloc <= devind)
+		alloc *= 2;
+	tab = realloc(pcidev, alloc * sizeof(*pcidev));
+	if (tab == NULL)
+		panic("PCI: unable to grow device table to %d entries", alloc);
+	memset(&tab[pcidev_alloc], 0, (alloc - pcidev_alloc) * sizeof(*tab));
+	pcidev = tab;
+
+	idtab = realloc(pciid, alloc * sizeof(*pciid));
+	if (idtab == NULL)
+		panic("PCI: unable to grow device table to %d entries", alloc);
+	memset(&idtab[pcidev_alloc], 0,
+		(alloc - pcidev_alloc) * sizeof(*idtab));
+	pciid = idtab;
+	pcidev_alloc = alloc;
+}
+
+/*===========================================================================*
+ *				pci_devind				     *
+ *===========================================================================*/
+static int pci_devind(int slot)
+{
+	/* The devind a driver gets for pcidev[slot] */
+	return (pcidev[slot].pd_tag << PCI_SLOT_BITS) | slot;
+}
+
+/*===========================================================================*
+ *				pci_slot				     *
+ *===========================================================================*/
+static int pci_slot(int devind, int *slotp)
+{
+	int slot;
+
+	/* Turn a devind from a driver back into its slot. EINVAL if it
+	 * never named one, ENODEV if the device it named is gone.
+	 */
+	slot = PCI_SLOT(devind);
+	if (devind < 0 || slot >= nr_pcidev)
+		return EINVAL;
+	if (pcidev[slot].pd_tag != PCI_TAG(devind) ||
+		(pciid[slot].pi_flags & PIF_GONE))
+		return ENODEV;
+	*slotp = slot;
+	return OK;
+}
+
+/*===========================================================================*
+ *				pci_reserve_bus				     *
+ *===========================================================================*/
+static void pci_reserve_bus(int busind)
+{
+	struct pcibus *tab;
+	int alloc;
+
+	if (busind < pcibus_alloc)
+		return;
+
+	alloc = pcibus_alloc ? pcibus_alloc : PCI_BUS_CHUNK;
+	while (alloc <= busind)
+		alloc *= 2;
+	tab = realloc(pcibus, alloc * sizeof(*pcibus));
+	if (tab == NULL)
+		panic("PCI: unable to grow bus table to %d entries", alloc);
+	memset(&tab[pcibus_alloc], 0, (alloc - pcibus_alloc) * sizeof(*tab));
+	pcibus = tab;
+	pcibus_alloc = alloc;
+}
+
+/*===========================================================================*
+ *				pci_mem_usage				     *
+ *===========================================================================*/
+static size_t pci_mem_usage(void)
+{
+	size_t size;
+	int i;
+
+	size = pcidev_alloc * (sizeof(*pciid) + sizeof(*pcidev)) +
+		pcibus_alloc * sizeof(*pcibus);
+	for (i = 0; i < 256; i++) {
+		if (pci_bdf_index[i] != NULL)
+			size += 256 * sizeof(*pci_bdf_index[i]);
+	}
+	return size;
+}
+
+static void pci_print_mem_usage(void)
+{
+	int i, nidx;
+
+	for (i = nidx = 0; i < 256; i++)
+		nidx += pci_bdf_index[i] != NULL;
+
+	printf("PCI: devices %d/%d (%u+%u bytes each), buses %d/%d "
+		"(%u bytes each), %d index tables, %u bytes total\n",
+		nr_pcidev, pcidev_alloc, (unsigned)sizeof(*pciid),
+		(unsigned)sizeof(*pcidev),
+		nr_pcibus, pcibus_alloc, (unsigned)sizeof(*pcibus),
+		nidx, (unsigned)pci_mem_usage());
+}
+
+/*===========================================================================*
+ *			Address space allocator				     *
+ *===========================================================================*/
+/* Free memory and I/O space for BARs, kept as a sorted array of disjoint
+ * ranges (struct res_alloc, above). ra_mem and ra_io hold what the host
+ * bridge decodes; every assigned bridge window has a set of its own.
+ * complete_bars seeds them with the assignable windows and takes out
+ * whatever firmware already assigned; removed devices give their BARs
+ * back with res_release, which only frees what lies in the seeded space.
+ */
+static struct res_alloc ra_mem, ra_io;
+static struct res_alloc ra_mem_seed, ra_io_seed;	/* as seeded */
+static int ra_seeded= 0;
+
+#define RA_ISA_ALIAS	0x300	/* I/O address bits that alias on ISA */
+
+/* Index of the first range that starts above base. */
+static int ra_find(struct res_alloc *ra, u64_t base)
+{
+	int lo = 0, hi = ra->ra_nr, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ra->ra_range[mid].rr_base <= base)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void ra_insert(struct res_alloc *ra, int pos, u64_t base, u64_t size)
+{
+	struct res_range *tab;
+	int alloc;
+
+	if (ra->ra_nr == ra->ra_alloc) {
+		alloc = ra->ra_alloc ? 2 * ra->ra_alloc : 16;
+		tab = realloc(ra->ra_range, alloc * sizeof(*tab));
+		if (tab == NULL)
+			panic("PCI: unable to grow resource list");
+		ra->ra_range = tab;
+		ra->ra_alloc = alloc;
+	}
+	memmove(&ra->ra_range[pos + 1], &ra->ra_range[pos],
+		(ra->ra_nr - pos) * sizeof(*ra->ra_range));
+	ra->ra_range[pos].rr_base = base;
+	ra->ra_range[pos].rr_size = size;
+	ra->ra_nr++;
+}
+
+static void ra_remove(struct res_alloc *ra, int pos)
+{
+	ra->ra_nr--;
+	memmove(&ra->ra_range[pos], &ra->ra_range[pos + 1],
+		(ra->ra_nr - pos) * sizeof(*ra->ra_range));
+}
+
+/*===========================================================================*
+ *				ra_reserve				     *
+ *===========================================================================*/
+static void ra_reserve(struct res_alloc *ra, u64_t base, u64_t size)
+{
+	struct res_range *r;
+	u64_t end, rend;
+	int i;
+
+	/* Take [base, base+size) out of the free space, wherever it
+	 * overlaps.
+	 */
+	end = base + size;
+	i = ra_find(ra, base);
+	if (i > 0)
+		i--;
+	for (; i < ra->ra_nr; i++) {
+		r = &ra->ra_range[i];
+		rend = r->rr_base + r->rr_size;
+		if (r->rr_base >= end)
+			break;
+		if (rend <= base)
+			continue;
+
+		if (r->rr_base < base && rend > end) {
+			r->rr_size = base - r->rr_base;
+			ra_insert(ra, i + 1, end, rend - end);
+			break;
+		}
+		if (r->rr_base < base) {
+			r->rr_size = base - r->rr_base;
+		} else if (rend > end) {
+			r->rr_size = rend - end;
+			r->rr_base = end;
+		} else {
+			ra_remove(ra, i);
+			i--;
+		}
+	}
+}
+
+/*===========================================================================*
+ *				ra_free					     *
+ *===========================================================================*/
+static void ra_free(struct res_alloc *ra, u64_t base, u64_t size)
+{
+	struct res_range *prev, *next;
+	int pos;
+
+	if (size == 0)
+		return;
+
+	ra_reserve(ra, base, size);	/* no double counting */
+
+	pos = ra_find(ra, base);
+	prev = pos > 0 ? &ra->ra_range[pos - 1] : NULL;
+	next = pos < ra->ra_nr ? &ra->ra_range[pos] : NULL;
+
+	if (prev != NULL && prev->rr_base + prev->rr_size == base) {
+		prev->rr_size += size;
+		if (next != NULL && base + size == next->rr_base) {
+			prev->rr_size += next->rr_size;
+			ra_remove(ra, pos);
+		}
+	} else if (next != NULL && base + size == next->rr_base) {
+		next->rr_base = base;
+		next->rr_size += size;
+	} else {
+		ra_insert(ra, pos, base, size);
+	}
+}
+
+/*===========================================================================*
+ *				ra_alloc				     *
+ *===========================================================================*/
+static int ra_alloc(struct res_alloc *ra, u64_t size, u64_t align,
+	u64_t limit, int noalias, u64_t *basep)
+{
+	struct res_range *r;
+	u64_t base, end;
+	int i;
+
+	/* Allocate top-down: the highest aligned block that fits below
+	 * limit. With noalias, I/O blocks are kept in the low 256 bytes of
+	 * a 1K block so that they don't alias ISA addresses.
+	 */
+	for (i = ra->ra_nr - 1; i >= 0; i--) {
+		r = &ra->ra_range[i];
+		end = r->rr_base + r->rr_size;
+		if (end > limit)
+			end = limit;
+		if (end <= r->rr_base || end - r->rr_base < size)
+			continue;
+		base = (end - size) & ~(align - 1);
+		if (noalias && (base & RA_ISA_ALIAS)) {
+			base = (base & ~(u64_t)0x3ff) + 0x100 - size;
+			base &= ~(align - 1);
+		}
+		if (base < r->rr_base)
+			continue;
+
+		ra_reserve(ra, base, size);
+		*basep = base;
+		return OK;
+	}
+	return ENOSPC;
+}
+
+/*===========================================================================*
+ *				ra_alloc_low				     *
+ *===========================================================================*/
+static int ra_alloc_low(struct res_alloc *ra, u64_t size, u64_t align,
+	u64_t limit, u64_t *basep)
+{
+	struct res_range *r;
+	u64_t base, end;
+	int i;
+
+	/* Allocate bottom-up: the lowest aligned block that fits. Windows
+	 * sized by win_size hold their contents packed upwards in order of
+	 * decreasing alignment, and this places them the same way.
+	 */
+	for (i = 0; i < ra->ra_nr; i++) {
+		r = &ra->ra_range[i];
+		end = r->rr_base + r->rr_size;
+		base = (r->rr_base + align - 1) & ~(align - 1);
+		if (base < r->rr_base || base >= end || end - base < size)
+			continue;
+		if (base + size > limit)
+			break;
+
+		ra_reserve(ra, base, size);
+		*basep = base;
+		return OK;
+	}
+	return ENOSPC;
+}
+
+/* Is all of [base, base+size) free? */
+static int ra_covers(struct res_alloc *ra, u64_t base, u64_t size)
+{
+	int i;
+
+	i = ra_find(ra, base) - 1;
+	return i >= 0 &&
+		ra->ra_range[i].rr_base + ra->ra_range[i].rr_size >= base + size;
+}
+
+static void ra_print(const char *name, struct res_alloc *ra)
+{
+	int i;
+
+	for (i = 0; i < ra->ra_nr; i++) {
+		printf("PCI: free %s [0x%llx..0x%llx>\n", name,
+			(unsigned long long)ra->ra_range[i].rr_base,
+			(unsigned long long)(ra->ra_range[i].rr_base +
+			ra->ra_range[i].rr_size));
+	}
+}
+
+static int win_parent(int busind)
+{
+	return pcidev[pcibus[busind].pb_devind].pd_busind;
+}
+
+/*===========================================================================*
+ *				win_pool				     *
+ *===========================================================================*/
+static struct res_alloc *win_pool(int busind, int w)
+{
+	/* Where space for window w of busind comes from, or NULL if that
+	 * window is not assigned.
+	 */
+	if (pcibus[busind].pb_type == PBT_INTEL_HOST)
+		return w == PBW_IO ? &ra_io : &ra_mem;
+	if (!(pcibus[busind].pb_win[w].pw_flags & PWF_SEEDED))
+		return NULL;
+	return &pcibus[busind].pb_win[w].pw_free;
+}
+
+/*===========================================================================*
+ *				res_win					     *
+ *===========================================================================*/
+static struct pci_win *res_win(int busind, int io, u64_t base)
+{
+	struct pci_win *wp;
+	int w;
 
-static int nr_pcidev= 0;
+	/* The innermost assigned window on the way from busind to the host
+	 * bridge that covers base, or NULL if there is none.
+	 */
+	while (pcibus[busind].pb_type != PBT_INTEL_HOST) {
+		for (w = 0; w < PBW_NR; w++) {
+			wp = &pcibus[busind].pb_win[w];
+			if (io != (w == PBW_IO) || !(wp->pw_flags & PWF_SEEDED))
+				continue;
+			if (base >= wp->pw_base && base - wp->pw_base < wp->pw_size)
+				return wp;
+		}
+		busind = win_parent(busind);
+	}
+	return NULL;
+}
+
+/*===========================================================================*
+ *				res_pool				     *
+ *===========================================================================*/
+static struct res_alloc *res_pool(int busind, int io, u64_t base)
+{
+	struct pci_win *wp;
+
+	/* The free set that a range at base on busind belongs to */
+	if ((wp = res_win(busind, io, base)) != NULL)
+		return &wp->pw_free;
+	return io ? &ra_io : &ra_mem;
+}
+
+/*===========================================================================*
+ *				res_release				     *
+ *===========================================================================*/
+static void res_release(int busind, int io, u64_t base, u64_t size)
+{
+	struct res_alloc *seed;
+	struct res_range *r;
+	struct pci_win *wp;
+	u64_t end, lo, hi;
+	int i;
+
+	/* Give [base, base+size) back to the set it was taken from, but
+	 * only the part of it that set was seeded with. Firmware may have
+	 * put a BAR or window where nothing above it decodes; that space
+	 * must not become allocatable when the device goes away.
+	 */
+	end = base + size;
+	if ((wp = res_win(busind, io, base)) != NULL) {
+		if (end - wp->pw_base > wp->pw_size)
+			end = wp->pw_base + wp->pw_size;
+		ra_free(&wp->pw_free, base, end - base);
+		return;
+	}
+
+	seed = io ? &ra_io_seed : &ra_mem_seed;
+	for (i = 0; i < seed->ra_nr; i++) {
+		r = &seed->ra_range[i];
+		lo = base > r->rr_base ? base : r->rr_base;
+		hi = r->rr_base + r->rr_size;
+		if (hi > end)
+			hi = end;
+		if (lo < hi)
+			ra_free(io ? &ra_io : &ra_mem, lo, hi - lo);
+	}
+}
 
 static struct machine machine;
 
+#if PCI_STATS
+static struct
+{
+	struct pci_stat st_width[3];	/* 8, 16 and 32-bit accesses */
+	struct pci_stat st_reg[PCI_EXT_CFG_SIZE / 4];	/* per dword */
+	struct pci_stat st_sts;		/* pb_rsts/pb_wsts */
+	unsigned long st_shadow_hits;
+	unsigned long st_kcalls;
+	unsigned long st_kfails;
+} pci_stats;
+
+#define STAT_COUNT(sp, write) \
+	((write) ? (sp)->ps_writes++ : (sp)->ps_reads++)
+#define STAT_CFG(busind, devind, port, width, write) \
+	(STAT_COUNT(&pcibus[busind].pb_stat, write), \
+	 STAT_COUNT(&pcidev[devind].pd_stat, write), \
+	 STAT_COUNT(&pci_stats.st_width[(width) >> 1], write), \
+	 STAT_COUNT(&pci_stats.st_reg[((port) >> 2) & \
+		(PCI_EXT_CFG_SIZE / 4 - 1)], write))
+#define STAT_STS(busind, write) \
+	(STAT_COUNT(&pcibus[busind].pb_stat, write), \
+	 STAT_COUNT(&pci_stats.st_sts, write))
+#define STAT_SHADOW_HIT()	(pci_stats.st_shadow_hits++)
+#define STAT_KCALL(s) \
+	(pci_stats.st_kcalls++, (s) != OK ? pci_stats.st_kfails++ : 0)
+#else
+#define STAT_CFG(busind, devind, port, width, write)	((void)0)
+#define STAT_STS(busind, write)				((void)0)
+#define STAT_SHADOW_HIT()				((void)0)
+#define STAT_KCALL(s)					((void)0)
+#endif
+
 /*===========================================================================*
  *			helper functions for I/O			     *
  *===========================================================================*/
 static unsigned pci_inb(u16_t port) {
     u32_t value = 0;
     int s = sys_inb(port, &value);
+    STAT_KCALL(s);
     if (s != OK) {
         printf("PCI: warning, sys_inb failed: %d\n", s);
         return 0;
@@ -110,6 +838,7 @@ static unsigned pci_inb(u16_t port) {
 static unsigned pci_inw(u16_t port) {
     u32_t value = 0;
     int s = sys_inw(port, &value);
+    STAT_KCALL(s);
     if (s != OK) {
         fprintf(stderr, "PCI: warning, sys_inw failed: %d\n", s);
         return 0;
@@ -120,6 +849,7 @@ static unsigned pci_inw(u16_t port) {
 static unsigned pci_inl(u16_t port) {
     u32_t value = 0;
     int s = sys_inl(port, &value);
+    STAT_KCALL(s);
     if (s != OK) {
         printf("PCI: warning, sys_inl failed: %d\n", s);
         return 0;
@@ -129,6 +859,7 @@ static unsigned pci_inl(u16_t port) {
 
 static void pci_outb(u16_t port, u8_t value) {
     int s = sys_outb(port, value);
+    STAT_KCALL(s);
     if (s != OK) {
         fprintf(stderr, "PCI: warning, sys_outb failed: %d\n", s);
     }
@@ -136,6 +867,7 @@ static void pci_outb(u16_t port, u8_t value) {
 
 static void pci_outw(u16_t port, u16_t value) {
 	int s = sys_outw(port, value);
+	STAT_KCALL(s);
 	if (s != OK) {
 		fprintf(stderr, "PCI: warning, sys_outw failed: %d\n", s);
 	}
@@ -143,121 +875,376 @@ static void pci_outw(u16_t port, u16_t value) {
 
 static void pci_outl(u16_t port, u32_t value) {
 	int ret = sys_outl(port, value);
+	STAT_KCALL(ret);
 	if (ret != OK) {
 		fprintf(stderr, "PCI: warning, sys_outl failed: %d\n", ret);
 	}
 }
 
-static u8_t pcii_rreg8(int busind, int devind, int port)
+static void pcii_flush(void)
 {
-    if (busind < 0 || devind < 0 || port < 0) {
-        printf("PCI: invalid parameter(s) in pcii_rreg8\n");
-        return 0;
-    }
+	int s;
 
-    u8_t v = PCII_RREG8_(pcibus[busind].pb_busnr,
-                         pcidev[devind].pd_dev, pcidev[devind].pd_func,
-                         port);
+	if (pcii_batch_nr == 0)
+		return;
 
-    int s = sys_outl(PCII_CONFADD, PCII_UNSEL);
-    if (s != OK) {
-        printf("PCI: warning, sys_outl failed: %d\n", s);
-    }
+	s = sys_voutl(pcii_batch, pcii_batch_nr);
+	STAT_KCALL(s);
+	if (s != OK)
+		printf("PCI: warning, sys_voutl failed: %d\n", s);
 
-    return v;
+	pcii_batch_nr = 0;
 }
 
-static u16_t pcii_rreg16(int busind, int devind, int port)
+/*===========================================================================*
+ *			CF8/CFC address latch				     *
+ *===========================================================================*/
+static void pcii_select(u32_t addr)
 {
-    u16_t v;
-    int s;
-
-    v = PCII_RREG16_(
-        pcibus[busind].pb_busnr,
-        pcidev[devind].pd_dev,
-        pcidev[devind].pd_func,
-        port);
-
-    s = sys_outl(PCII_CONFADD, PCII_UNSEL);
-    if (s != OK)
-    {
-        printf("PCI: warning, sys_outl failed: %d\n", s);
-    }
+	pcii_latch_stats.pls_accesses++;
+	if (pcii_latched == addr) {
+		pcii_latch_stats.pls_sel_elided++;
+		return;
+	}
+	pci_outl(PCII_CONFADD, addr);
+	pcii_latched = addr;
+	pcii_latch_stats.pls_sel_written++;
+}
 
-    return v;
+/*===========================================================================*
+ *				pcii_unselect				     *
+ *===========================================================================*/
+static void pcii_unselect(void)
+{
+	/* Serialization point: drop whatever is latched in CF8. Called at the
+	 * end of an enumeration pass, before talking to other servers and
+	 * before a request returns to the IPC loop.
+	 */
+	pcii_flush();
+	if (pcii_latched == PCII_UNSEL) {
+		pcii_latch_stats.pls_unsel_elided++;
+		return;
+	}
+	pci_outl(PCII_CONFADD, PCII_UNSEL);
+	pcii_latched = PCII_UNSEL;
+	pcii_latch_stats.pls_unsel_written++;
 }
 
-static u32_t pcii_rreg32(int busind, int devind, int port)
+static void pcii_queue32(int busnr, int dev, int func, int port, u32_t value)
 {
-    u32_t v;
-    int s;
+	u32_t addr;
 
-    v = PCII_RREG32_(pcibus[busind].pb_busnr,
-                     pcidev[devind].pd_dev, pcidev[devind].pd_func,
-                     port);
-    s = sys_outl(PCII_CONFADD, PCII_UNSEL);
-    if (s != OK) {
-        fprintf(stderr, "PCI: warning, sys_outl failed: %d\n", s);
-    }
+	if (pcii_batch_nr + 2 > 2 * PCII_BATCH_MAX)
+		pcii_flush();
 
-    return v;
+	/* pcii_latched describes the state after the queue has been flushed;
+	 * nothing else touches CF8 before that happens.
+	 */
+	addr = PCII_SELREG_(busnr, dev, func, port);
+	pcii_latch_stats.pls_accesses++;
+	if (pcii_latched != addr) {
+		pv_set(pcii_batch[pcii_batch_nr], PCII_CONFADD, addr);
+		pcii_batch_nr++;
+		pcii_latched = addr;
+		pcii_latch_stats.pls_sel_written++;
+	} else {
+		pcii_latch_stats.pls_sel_elided++;
+	}
+	pv_set(pcii_batch[pcii_batch_nr], PCII_CONFDATA, value);
+	pcii_batch_nr++;
 }
 
-static void pcii_wreg8(int busind, int devind, int port, u8_t value)
+/*===========================================================================*
+ *				pci_batch_begin				     *
+ *===========================================================================*/
+static void pci_batch_begin(void)
 {
-    int s;
-
-    PCII_WREG8_(pcibus[busind].pb_busnr,
-                pcidev[devind].pd_dev, pcidev[devind].pd_func,
-                port, value);
-    s = sys_outl(PCII_CONFADD, PCII_UNSEL);
-    if (s != OK) {
-        printf("PCI: warning, sys_outl failed: %d\n", s);
-    }
+	pcii_batching++;
 }
 
-static void pcii_wreg16(int busind, int devind, int port, u16_t value)
+/*===========================================================================*
+ *				pci_batch_end				     *
+ *===========================================================================*/
+static void pci_batch_end(void)
 {
-	int s;
+	if (pcii_batching > 0 && --pcii_batching == 0)
+		pcii_flush();
+}
 
-	PCII_WREG16_(
-		pcibus[busind].pb_busnr,
-		pcidev[devind].pd_dev,
-		pcidev[devind].pd_func,
-		port,
-		value
-	);
+static void pcii_print_latch_stats(void)
+{
+	unsigned long saved;
 
-	s = sys_outl(PCII_CONFADD, PCII_UNSEL);
-	if (s != OK) {
-		fprintf(stderr, "PCI: warning, sys_outl failed: %d\n", s);
-	}
+	/* Without latch tracking every access costs an address write and an
+	 * unselect write.
+	 */
+	saved = pcii_latch_stats.pls_sel_elided +
+		(pcii_latch_stats.pls_accesses -
+		pcii_latch_stats.pls_unsel_written);
+
+	printf("PCI: CF8 latch: %lu accesses, %lu/%lu selects elided, "
+		"%lu unselects written, %lu port writes saved\n",
+		pcii_latch_stats.pls_accesses,
+		pcii_latch_stats.pls_sel_elided,
+		pcii_latch_stats.pls_sel_elided +
+		pcii_latch_stats.pls_sel_written,
+		pcii_latch_stats.pls_unsel_written, saved);
 }
 
-static void pcii_wreg32(int busind, int devind, int port, u32_t value)
+static u8_t pcii_rreg8(int busind, int devind, int port)
 {
-    int s;
-    if (busind < 0 || devind < 0 ||
-        busind >= (int)(sizeof(pcibus)/sizeof(pcibus[0])) ||
-        devind >= (int)(sizeof(pcidev)/sizeof(pcidev[0]))) {
-        printf("PCI: invalid busind (%d) or devind (%d)\n", busind, devind);
-        return;
+    if (busind < 0 || devind < 0 || port < 0) {
+        printf("PCI: invalid parameter(s) in pcii_rreg8\n");
+        return 0;
     }
 
-    PCII_WREG32_(
+    pcii_flush();
+    pcii_select(PCII_SELREG_(pcibus[busind].pb_busnr,
+                pciid[devind].pi_dev, pciid[devind].pi_func, port));
+    return pci_inb(PCII_CONFDATA + (port & 3));
+}
+
+static u16_t pcii_rreg16(int busind, int devind, int port)
+{
+    pcii_flush();
+    pcii_select(PCII_SELREG_(
         pcibus[busind].pb_busnr,
-        pcidev[devind].pd_dev,
-        pcidev[devind].pd_func,
-        port, value
-    );
+        pciid[devind].pi_dev,
+        pciid[devind].pi_func,
+        port));
+    return pci_inw(PCII_CONFDATA + (port & 2));
+}
 
-    s = sys_outl(PCII_CONFADD, PCII_UNSEL);
-    if (s != OK) {
-        printf("PCI: warning, sys_outl failed: %d\n", s);
-    }
+static u32_t pcii_rreg32(int busind, int devind, int port)
+{
+    pcii_flush();
+    pcii_select(PCII_SELREG_(pcibus[busind].pb_busnr,
+                pciid[devind].pi_dev, pciid[devind].pi_func, port));
+    return pci_inl(PCII_CONFDATA);
 }
 
-/*===========================================================================*
+static void pcii_wreg8(int busind, int devind, int port, u8_t value)
+{
+    pcii_flush();
+    pcii_select(PCII_SELREG_(pcibus[busind].pb_busnr,
+                pciid[devind].pi_dev, pciid[devind].pi_func, port));
+    pci_outb(PCII_CONFDATA + (port & 3), value);
+}
+
+static void pcii_wreg16(int busind, int devind, int port, u16_t value)
+{
+	pcii_flush();
+	pcii_select(PCII_SELREG_(
+		pcibus[busind].pb_busnr,
+		pciid[devind].pi_dev,
+		pciid[devind].pi_func,
+		port
+	));
+	pci_outw(PCII_CONFDATA + (port & 2), value);
+}
+
+static void pcii_wreg32(int busind, int devind, int port, u32_t value)
+{
+    if (busind < 0 || devind < 0 ||
+        busind >= pcibus_alloc || devind >= pcidev_alloc) {
+        printf("PCI: invalid busind (%d) or devind (%d)\n", busind, devind);
+        return;
+    }
+
+    if (pcii_batching) {
+        pcii_queue32(pcibus[busind].pb_busnr, pciid[devind].pi_dev,
+            pciid[devind].pi_func, port, value);
+        return;
+    }
+
+    pcii_select(PCII_SELREG_(
+        pcibus[busind].pb_busnr,
+        pciid[devind].pi_dev,
+        pciid[devind].pi_func,
+        port
+    ));
+    pci_outl(PCII_CONFDATA, value);
+}
+
+/*===========================================================================*
+ *			ECAM (memory-mapped) configuration access	     *
+ *===========================================================================*/
+static u8_t ecam_rreg8(int busind, int devind, int port)
+{
+	return *(volatile u8_t *)(pcibus[busind].pb_ecam +
+		ECAM_OFF(pciid[devind].pi_dev, pciid[devind].pi_func, port));
+}
+
+static u16_t ecam_rreg16(int busind, int devind, int port)
+{
+	return *(volatile u16_t *)(pcibus[busind].pb_ecam +
+		ECAM_OFF(pciid[devind].pi_dev, pciid[devind].pi_func, port));
+}
+
+static u32_t ecam_rreg32(int busind, int devind, int port)
+{
+	return *(volatile u32_t *)(pcibus[busind].pb_ecam +
+		ECAM_OFF(pciid[devind].pi_dev, pciid[devind].pi_func, port));
+}
+
+static void ecam_wreg8(int busind, int devind, int port, u8_t value)
+{
+	*(volatile u8_t *)(pcibus[busind].pb_ecam +
+		ECAM_OFF(pciid[devind].pi_dev, pciid[devind].pi_func, port)) =
+		value;
+}
+
+static void ecam_wreg16(int busind, int devind, int port, u16_t value)
+{
+	*(volatile u16_t *)(pcibus[busind].pb_ecam +
+		ECAM_OFF(pciid[devind].pi_dev, pciid[devind].pi_func, port)) =
+		value;
+}
+
+static void ecam_wreg32(int busind, int devind, int port, u32_t value)
+{
+	*(volatile u32_t *)(pcibus[busind].pb_ecam +
+		ECAM_OFF(pciid[devind].pi_dev, pciid[devind].pi_func, port)) =
+		value;
+}
+
+static u16_t ecam_rsts(int busind)
+{
+	return *(volatile u16_t *)(pcibus[busind].pb_ecam +
+		ECAM_OFF(0, 0, PCI_SR));
+}
+
+static void ecam_wsts(int busind, u16_t value)
+{
+	*(volatile u16_t *)(pcibus[busind].pb_ecam +
+		ECAM_OFF(0, 0, PCI_SR)) = value;
+}
+
+#ifdef PCI_SIM
+/*===========================================================================*
+ *			Simulated configuration access			     *
+ *===========================================================================*/
+static u8_t sim_rreg8(int busind, int devind, int port)
+{
+	return pcisim_read(pcibus[busind].pb_busnr, pciid[devind].pi_dev,
+		pciid[devind].pi_func, port, 1);
+}
+
+static u16_t sim_rreg16(int busind, int devind, int port)
+{
+	return pcisim_read(pcibus[busind].pb_busnr, pciid[devind].pi_dev,
+		pciid[devind].pi_func, port, 2);
+}
+
+static u32_t sim_rreg32(int busind, int devind, int port)
+{
+	return pcisim_read(pcibus[busind].pb_busnr, pciid[devind].pi_dev,
+		pciid[devind].pi_func, port, 4);
+}
+
+static void sim_wreg8(int busind, int devind, int port, u8_t value)
+{
+	pcisim_write(pcibus[busind].pb_busnr, pciid[devind].pi_dev,
+		pciid[devind].pi_func, port, 1, value);
+}
+
+static void sim_wreg16(int busind, int devind, int port, u16_t value)
+{
+	pcisim_write(pcibus[busind].pb_busnr, pciid[devind].pi_dev,
+		pciid[devind].pi_func, port, 2, value);
+}
+
+static void sim_wreg32(int busind, int devind, int port, u32_t value)
+{
+	pcisim_write(pcibus[busind].pb_busnr, pciid[devind].pi_dev,
+		pciid[devind].pi_func, port, 4, value);
+}
+
+static u16_t sim_rsts(int busind)
+{
+	return pcisim_read(pcibus[busind].pb_busnr, 0, 0, PCI_SR, 2);
+}
+
+static void sim_wsts(int busind, u16_t value)
+{
+	pcisim_write(pcibus[busind].pb_busnr, 0, 0, PCI_SR, 2, value);
+}
+#endif /* PCI_SIM */
+
+static struct pcie_ecam *ecam_lookup(int segment, int busnr)
+{
+	for (int i = 0; i < nr_ecam; i++) {
+		if (pcie_ecam[i].pe_segment == segment &&
+		    busnr >= pcie_ecam[i].pe_startbus &&
+		    busnr <= pcie_ecam[i].pe_endbus) {
+			return &pcie_ecam[i];
+		}
+	}
+	return NULL;
+}
+
+/*===========================================================================*
+ *				ecam_init				     *
+ *===========================================================================*/
+static void ecam_init(void)
+{
+#if PCI_ECAM
+	struct pcie_ecam *pe;
+	u64_t base;
+	int idx, segment, startbus, endbus;
+	size_t len;
+	void *vaddr;
+
+	if (!use_ecam || !machine.apic_enabled)
+		return;
+
+	/* ACPI has already been initialized by sef_cb_init when the APIC is
+	 * enabled; ask it for the MCFG allocations and map each one once.
+	 */
+	for (idx = 0; nr_ecam < NR_ECAM; idx++) {
+		if (acpi_get_mcfg(idx, &base, &segment, &startbus,
+		    &endbus) != OK)
+			break;
+
+		if (startbus < 0 || endbus > 255 || endbus < startbus) {
+			printf("PCI: ignoring bad MCFG entry %d (bus %d-%d)\n",
+				idx, startbus, endbus);
+			continue;
+		}
+		if (base + ((u64_t)(endbus + 1) << ECAM_BUS_SHIFT) - 1 >
+		    (phys_bytes)~0) {
+			printf("PCI: MCFG entry %d above addressable memory\n",
+				idx);
+			continue;
+		}
+
+		len = (size_t)(endbus - startbus + 1) << ECAM_BUS_SHIFT;
+		vaddr = vm_map_phys(SELF,
+			(void *)(phys_bytes)(base +
+			((u64_t)startbus << ECAM_BUS_SHIFT)), len);
+		if (vaddr == MAP_FAILED) {
+			printf("PCI: unable to map ECAM window at 0x%llx\n",
+				(unsigned long long)base);
+			continue;
+		}
+
+		pe = &pcie_ecam[nr_ecam++];
+		pe->pe_segment = segment;
+		pe->pe_startbus = startbus;
+		pe->pe_endbus = endbus;
+		pe->pe_base = base;
+		pe->pe_vaddr = vaddr;
+
+		if (debug) {
+			printf("PCI: ECAM segment %d, bus %d-%d at 0x%llx\n",
+				segment, startbus, endbus,
+				(unsigned long long)base);
+		}
+	}
+#endif /* PCI_ECAM */
+}
+
+/*===========================================================================*
  *				ntostr					     *
  *===========================================================================*/
 static void ntostr(unsigned int n, char **str, const char *end)
@@ -293,12 +1280,85 @@ static void ntostr(unsigned int n, char **str, const char *end)
  *===========================================================================*/
 static int get_busind(int busnr)
 {
-    for (int i = 0; i < nr_pcibus; i++) {
-        if (pcibus[i].pb_busnr == busnr) {
-            return i;
-        }
-    }
-    return -1;
+    if (busnr < 0 || busnr > 255)
+        return -1;
+    return pci_busmap[busnr] - 1;
+}
+
+/*===========================================================================*
+ *			Configuration space shadow			     *
+ *===========================================================================*/
+static u64_t shadow_mask(u8_t headt)
+{
+	switch (headt & PHT_MASK) {
+	case PHT_NORMAL:
+		return SHADOW_PROBE |
+			SHADOW_DW(PCI_BAR) | SHADOW_DW(PCI_BAR_2) |
+			SHADOW_DW(PCI_BAR_3) | SHADOW_DW(PCI_BAR_4) |
+			SHADOW_DW(PCI_BAR_5) | SHADOW_DW(PCI_BAR_6) |
+			SHADOW_DW(PCI_SUBVID) | SHADOW_DW(PCI_CAPPTR) |
+			SHADOW_DW(PCI_ILR);
+	case PHT_BRIDGE:
+		return SHADOW_PROBE |
+			SHADOW_DW(PCI_BAR) | SHADOW_DW(PCI_BAR_2) |
+			SHADOW_DW(PPB_PRIMBN) | SHADOW_DW(PPB_MEMBASE) |
+			SHADOW_DW(PPB_PFMEMBASE) | SHADOW_DW(PPB_IOBASEU16) |
+			SHADOW_DW(PCI_CAPPTR);
+	case PHT_CARDBUS:
+		return SHADOW_PROBE |
+			SHADOW_DW(PCI_BAR) |
+			SHADOW_DW(CBB_MEMBASE_0) | SHADOW_DW(CBB_MEMLIMIT_0) |
+			SHADOW_DW(CBB_MEMBASE_1) | SHADOW_DW(CBB_MEMLIMIT_1) |
+			SHADOW_DW(CBB_IOBASE_0) | SHADOW_DW(CBB_IOLIMIT_0) |
+			SHADOW_DW(CBB_IOBASE_1) | SHADOW_DW(CBB_IOLIMIT_1);
+	default:
+		return SHADOW_PROBE;
+	}
+}
+
+static void shadow_reset(int devind, u64_t ok)
+{
+	pcidev[devind].pd_shadow_ok = ok;
+	pcidev[devind].pd_shadow_valid = 0;
+}
+
+static int shadow_get(int devind, int busind, int port, u32_t *vp)
+{
+	struct pcidev *pd = &pcidev[devind];
+	u64_t bit;
+	u32_t v;
+
+	if (port >= PCI_SHADOW_SIZE)
+		return 0;
+	bit = SHADOW_DW(port);
+	if (!(pd->pd_shadow_ok & bit))
+		return 0;
+
+	if (!(pd->pd_shadow_valid & bit)) {
+		if (!pcibus[busind].pb_rreg32)
+			return 0;
+		STAT_CFG(busind, devind, port & ~3, 4, 0);
+		v = pcibus[busind].pb_rreg32(busind, devind, port & ~3);
+		pd->pd_shadow[port >> 2] = v;
+
+		/* The BIST register changes while a self test runs. */
+		if ((port >> 2) == (PCI_HEADT >> 2) && (v & 0x80000000))
+			pd->pd_shadow_ok &= ~bit;
+		else
+			pd->pd_shadow_valid |= bit;
+	} else {
+		STAT_SHADOW_HIT();
+	}
+	*vp = pd->pd_shadow[port >> 2];
+	return 1;
+}
+
+static void shadow_inval(int devind, int port, int width)
+{
+	if (port >= PCI_SHADOW_SIZE)
+		return;
+	pcidev[devind].pd_shadow_valid &=
+		~(SHADOW_DW(port) | SHADOW_DW(port + width - 1));
 }
 
 /*===========================================================================*
@@ -306,73 +1366,86 @@ static int get_busind(int busnr)
  *===========================================================================*/
 static u8_t __pci_attr_r8(int devind, int port)
 {
-	int busnr = pcidev[devind].pd_busnr;
-	int busind = get_busind(busnr);
+	u32_t v;
+	int busind = pcidev[devind].pd_busind;
 
-	if (busind < 0 || busind >= MAX_PCI_BUSES) {
+	if (busind < 0 || busind >= pcibus_alloc) {
 		/* Handle error: invalid bus index */
 		return 0;
 	}
+	if (shadow_get(devind, busind, port, &v))
+		return (u8_t)(v >> (8 * (port & 3)));
 	if (!pcibus[busind].pb_rreg8) {
 		/* Handle error: function pointer is NULL */
 		return 0;
 	}
+	STAT_CFG(busind, devind, port, 1, 0);
 	return pcibus[busind].pb_rreg8(busind, devind, port);
 }
 
 
 static u16_t __pci_attr_r16(int devind, int port) {
-    int busnr = pcidev[devind].pd_busnr;
-    int busind = get_busind(busnr);
+    u32_t v;
+    int busind = pcidev[devind].pd_busind;
 
     if (busind < 0) {
         return 0;
     }
 
+    if (shadow_get(devind, busind, port, &v)) {
+        return (u16_t)(v >> (8 * (port & 2)));
+    }
+
     if (!pcibus[busind].pb_rreg16) {
         return 0;
     }
 
+    STAT_CFG(busind, devind, port, 2, 0);
     return pcibus[busind].pb_rreg16(busind, devind, port);
 }
 
 static u32_t __pci_attr_r32(int devind, int port)
 {
-    int busnr = pcidev[devind].pd_busnr;
-    int busind = get_busind(busnr);
+    u32_t v;
+    int busind = pcidev[devind].pd_busind;
     if (busind < 0) {
         return 0;
     }
+    if (shadow_get(devind, busind, port, &v)) {
+        return v;
+    }
     if (!pcibus[busind].pb_rreg32) {
         return 0;
     }
+    STAT_CFG(busind, devind, port, 4, 0);
     return pcibus[busind].pb_rreg32(busind, devind, port);
 }
 
 static void __pci_attr_w8(int devind, int port, u8_t value)
 {
-    if (devind < 0 || devind >= PCIDEV_MAX)
+    if (devind < 0 || devind >= pcidev_alloc)
         return;
 
-    int busnr = pcidev[devind].pd_busnr;
-    int busind = get_busind(busnr);
-    if (busind < 0 || busind >= PCIBUS_MAX || pcibus[busind].pb_wreg8 == NULL)
+    int busind = pcidev[devind].pd_busind;
+    if (busind < 0 || busind >= pcibus_alloc || pcibus[busind].pb_wreg8 == NULL)
         return;
 
+    shadow_inval(devind, port, 1);
+    STAT_CFG(busind, devind, port, 1, 1);
     pcibus[busind].pb_wreg8(busind, devind, port, value);
 }
 
 static void __pci_attr_w16(int devind, int port, u16_t value)
 {
-    int busnr;
     int busind;
 
-    if (devind < 0 || devind >= PCIDEV_MAX)
+    if (devind < 0 || devind >= pcidev_alloc)
         return;
-    busnr = pcidev[devind].pd_busnr;
-    busind = get_busind(busnr);
-    if (busind < 0 || busind >= PCIBUS_MAX || !pcibus[busind].pb_wreg16)
+    busind = pcidev[devind].pd_busind;
+    if (busind < 0 || busind >= pcibus_alloc || !pcibus[busind].pb_wreg16)
         return;
+    shadow_inval(devind, port, 2);
+    STAT_CFG(busind, devind, port, 2, 1);
     pcibus[busind].pb_wreg16(busind, devind, port, value);
 }
 
@@ -380,98 +1453,295 @@ static void __pci_attr_w32(int devind, int port, u32_t value)
 {
     int busind;
 
-    busind = get_busind(pcidev[devind].pd_busnr);
+    busind = pcidev[devind].pd_busind;
     if (busind < 0 || !pcibus[busind].pb_wreg32) {
         return;
     }
+    shadow_inval(devind, port, 4);
+    STAT_CFG(busind, devind, port, 4, 1);
     pcibus[busind].pb_wreg32(busind, devind, port, value);
 }
 
 /*===========================================================================*
  *				helpers					     *
  *===========================================================================*/
-static u16_t pci_attr_rsts(int devind)
+static u16_t pci_attr_rsts(int busind)
 {
-	int busnr, busind;
-
-	if (devind < 0 || devind >= PCI_DEV_MAX) {
+	if (busind < 0 || busind >= nr_pcibus || !pcibus[busind].pb_rsts) {
 		return 0;
 	}
 
-	busnr = pcidev[devind].pd_busnr;
-	busind = get_busind(busnr);
+	STAT_STS(busind, 0);
+	return pcibus[busind].pb_rsts(busind);
+}
 
-	if (busind < 0 || busind >= PCI_BUS_MAX || !pcibus[busind].pb_rsts) {
-		return 0;
+static void pci_attr_wsts(int busind, u16_t value)
+{
+	if (busind < 0 || busind >= nr_pcibus || pcibus[busind].pb_wsts == NULL) {
+		return;
 	}
 
-	return pcibus[busind].pb_rsts(busind);
+	STAT_STS(busind, 1);
+	pcibus[busind].pb_wsts(busind, value);
+}
+
+static u16_t pcii_rsts(int busind)
+{
+    pcii_flush();
+    pcii_select(PCII_SELREG_(pcibus[busind].pb_busnr, 0, 0, PCI_SR));
+    return pci_inw(PCII_CONFDATA + (PCI_SR & 2));
 }
 
-static void pci_attr_wsts(int devind, u16_t value)
+static void pcii_wsts(int busind, u16_t value)
 {
-	if (devind < 0 || devind >= PCIDEV_SIZE) {
+	if (busind < 0 || busind >= pcibus_alloc) {
+		printf("PCI: error, invalid bus index: %d\n", busind);
 		return;
 	}
 
-	int busnr = pcidev[devind].pd_busnr;
-	int busind = get_busind(busnr);
+	pcii_flush();
+	pcii_select(PCII_SELREG_(pcibus[busind].pb_busnr, 0, 0, PCI_SR));
+	pci_outw(PCII_CONFDATA + (PCI_SR & 2), value);
+}
+
+/*===========================================================================*
+ *				pci_set_access				     *
+ *===========================================================================*/
+static void pci_set_access(int busind)
+{
+	struct pcibus *pb = &pcibus[busind];
+	struct pcie_ecam *pe;
 
-	if (busind < 0 || busind >= PCIBUS_SIZE || pcibus[busind].pb_wsts == NULL) {
+	/* Select the configuration mechanism for this bus: the ECAM window
+	 * if one covers the bus number, CF8/CFC otherwise. Must be called
+	 * again whenever pb_busnr changes.
+	 */
+#ifdef PCI_SIM
+	if (pcisim_active()) {
+		pb->pb_ecam = NULL;
+		pb->pb_rreg8 = sim_rreg8;
+		pb->pb_rreg16 = sim_rreg16;
+		pb->pb_rreg32 = sim_rreg32;
+		pb->pb_wreg8 = sim_wreg8;
+		pb->pb_wreg16 = sim_wreg16;
+		pb->pb_wreg32 = sim_wreg32;
+		pb->pb_cfgsize = PCISIM_CFG_SIZE;
+		if (pb->pb_type == PBT_INTEL_HOST) {
+			pb->pb_rsts = sim_rsts;
+			pb->pb_wsts = sim_wsts;
+		}
 		return;
 	}
+#endif
+	pe = ecam_lookup(pb->pb_segment, pb->pb_busnr);
+	if (pe != NULL) {
+		pb->pb_ecam = pe->pe_vaddr +
+			((pb->pb_busnr - pe->pe_startbus) << ECAM_BUS_SHIFT);
+		pb->pb_rreg8 = ecam_rreg8;
+		pb->pb_rreg16 = ecam_rreg16;
+		pb->pb_rreg32 = ecam_rreg32;
+		pb->pb_wreg8 = ecam_wreg8;
+		pb->pb_wreg16 = ecam_wreg16;
+		pb->pb_wreg32 = ecam_wreg32;
+		pb->pb_cfgsize = PCI_EXT_CFG_SIZE;
+	} else {
+		pb->pb_ecam = NULL;
+		pb->pb_rreg8 = pcii_rreg8;
+		pb->pb_rreg16 = pcii_rreg16;
+		pb->pb_rreg32 = pcii_rreg32;
+		pb->pb_wreg8 = pcii_wreg8;
+		pb->pb_wreg16 = pcii_wreg16;
+		pb->pb_wreg32 = pcii_wreg32;
+		pb->pb_cfgsize = PCI_CFG_SIZE;
+	}
 
-	pcibus[busind].pb_wsts(busind, value);
+	if (pb->pb_type == PBT_INTEL_HOST) {
+		pb->pb_rsts = pe != NULL ? ecam_rsts : pcii_rsts;
+		pb->pb_wsts = pe != NULL ? ecam_wsts : pcii_wsts;
+	}
 }
 
-static u16_t pcii_rsts(int busind)
+/*===========================================================================*
+ *				pci_set_busnr				     *
+ *===========================================================================*/
+static void pci_set_busnr(int busind, int busnr)
 {
-    u16_t v;
-    int s;
+	struct pcibus *pb = &pcibus[busind];
 
-    v = PCII_RREG16_(pcibus[busind].pb_busnr, 0, 0, PCI_SR);
-    s = sys_outl(PCII_CONFADD, PCII_UNSEL);
-    if (s != OK) {
-        fprintf(stderr, "PCI: warning, sys_outl failed: %d\n", s);
-    }
-    return v;
+	/* Give a bus table entry its (new) bus number, keep pci_busmap in
+	 * step and reselect the configuration mechanism.
+	 */
+	if (pci_busmap[pb->pb_busnr] == busind + 1)
+		pci_busmap[pb->pb_busnr] = 0;
+	pb->pb_busnr = busnr;
+	pci_busmap[busnr] = busind + 1;
+	pci_set_access(busind);
 }
 
-static void pcii_wsts(int busind, u16_t value)
+/*===========================================================================*
+ *				pci_bus_link				     *
+ *===========================================================================*/
+static void pci_bus_link(int busind, int devind)
 {
-	if (busind < 0 || busind >= PCIBUS_MAX_NR) {
-		printf("PCI: error, invalid bus index: %d\n", busind);
-		return;
-	}
+	struct pcibus *pb = &pcibus[busind];
+
+	pcidev[devind].pd_next = -1;
+	if (pb->pb_last_dev < 0)
+		pb->pb_first_dev = devind;
+	else
+		pcidev[pb->pb_last_dev].pd_next = devind;
+	pb->pb_last_dev = devind;
+}
 
-	PCII_WREG16_(pcibus[busind].pb_busnr, 0, 0, PCI_SR, value);
+/*===========================================================================*
+ *				pci_index_lookup			     *
+ *===========================================================================*/
+static int pci_index_lookup(u8_t busnr, u8_t dev, u8_t func)
+{
+	if (pci_bdf_index[busnr] == NULL)
+		return -1;
+	return pci_bdf_index[busnr][PCI_DEVFN(dev, func)];
+}
 
-	if (sys_outl(PCII_CONFADD, PCII_UNSEL) != OK) {
-		printf("PCI: warning, sys_outl failed\n");
+/*===========================================================================*
+ *				pci_index_add				     *
+ *===========================================================================*/
+static void pci_index_add(int devind)
+{
+	int i, busnr;
+	int *tab;
+
+	busnr = pciid[devind].pi_busnr;
+	if ((tab = pci_bdf_index[busnr]) == NULL) {
+		tab = malloc(256 * sizeof(*tab));
+		if (tab == NULL)
+			panic("PCI: unable to allocate index for bus %d", busnr);
+		for (i = 0; i < 256; i++)
+			tab[i] = -1;
+		pci_bdf_index[busnr] = tab;
 	}
+	tab[PCI_DEVFN(pciid[devind].pi_dev, pciid[devind].pi_func)] = devind;
+}
+
+/*===========================================================================*
+ *				pci_index_del				     *
+ *===========================================================================*/
+static void pci_index_del(int devind)
+{
+	int *tab;
+	int devfn;
+
+	tab = pci_bdf_index[pciid[devind].pi_busnr];
+	devfn = PCI_DEVFN(pciid[devind].pi_dev, pciid[devind].pi_func);
+	if (tab != NULL && tab[devfn] == devind)
+		tab[devfn] = -1;
 }
 
 static int is_duplicate(u8_t busnr, u8_t dev, u8_t func)
 {
-	for (int i = 0; i < nr_pcidev; i++) {
-		if (pcidev[i].pd_busnr == busnr &&
-		    pcidev[i].pd_dev == dev &&
-		    pcidev[i].pd_func == func)
-			return 1;
-	}
-	return 0;
+	int devind = pci_index_lookup(busnr, dev, func);
+
+	return devind >= 0 && !(pciid[devind].pi_flags & PIF_GONE);
 }
 
-static int get_freebus(void)
+/*===========================================================================*
+ *				pci_bus_unlink				     *
+ *===========================================================================*/
+static void pci_bus_unlink(int busind, int devind)
 {
-    int freebus = 1;
-    for (int i = 0; i < nr_pcibus; i++) {
-        if (pcibus[i].pb_needinit || pcibus[i].pb_type == PBT_INTEL_HOST)
-            continue;
-        if (pcibus[i].pb_busnr <= freebus)
-            freebus = pcibus[i].pb_busnr + 1;
-    }
-    return freebus;
+	struct pcibus *pb = &pcibus[busind];
+	int prev, i;
+
+	prev = -1;
+	for (i = pb->pb_first_dev; i >= 0 && i != devind; i = pcidev[i].pd_next)
+		prev = i;
+	if (i < 0)
+		return;
+
+	if (prev < 0)
+		pb->pb_first_dev = pcidev[devind].pd_next;
+	else
+		pcidev[prev].pd_next = pcidev[devind].pd_next;
+	if (pb->pb_last_dev == devind)
+		pb->pb_last_dev = prev;
+	pcidev[devind].pd_next = -1;
+}
+
+/*===========================================================================*
+ *				pci_del_dev				     *
+ *===========================================================================*/
+static void pci_del_dev(int devind)
+{
+	struct pci_win *wp;
+	struct bar *bp;
+	int busind, next, i;
+
+	/* The function is gone. Take it off its bus and drop its BARs so
+	 * their space no longer counts as used. The slot is marked gone and
+	 * goes on the free list with a new tag, so stale devinds held by
+	 * drivers get ENODEV even once the slot holds another device.
+	 * Everything behind a removed bridge goes with it, its windows go
+	 * back to the space above, and the bus numbers become free again.
+	 */
+	if (debug) {
+		printf("PCI: %d.%d.%d removed\n", pciid[devind].pi_busnr,
+			pciid[devind].pi_dev, pciid[devind].pi_func);
+	}
+
+	for (busind = 0; busind < nr_pcibus; busind++) {
+		if (pcibus[busind].pb_devind != devind ||
+			pcibus[busind].pb_type == PBT_GONE)
+			continue;
+
+		for (i = pcibus[busind].pb_first_dev; i >= 0; i = next) {
+			next = pcidev[i].pd_next;
+			pci_del_dev(i);
+		}
+		for (i = 0; i < PBW_NR; i++) {
+			wp = &pcibus[busind].pb_win[i];
+			if (wp->pw_flags & PWF_SEEDED) {
+				res_release(pcidev[devind].pd_busind,
+					i == PBW_IO, wp->pw_base, wp->pw_size);
+			}
+			free(wp->pw_free.ra_range);
+			memset(wp, 0, sizeof(*wp));
+		}
+		if (!pcibus[busind].pb_needinit) {
+			ra_free(&pcibus[pcidev[devind].pd_busind].pb_busfree,
+				pcibus[busind].pb_busnr, pcibus[busind].pb_subord -
+				pcibus[busind].pb_busnr + 1);
+			if (pci_busmap[pcibus[busind].pb_busnr] == busind + 1)
+				pci_busmap[pcibus[busind].pb_busnr] = 0;
+		}
+		free(pcibus[busind].pb_busfree.ra_range);
+		memset(&pcibus[busind].pb_busfree, 0,
+			sizeof(pcibus[busind].pb_busfree));
+		pcibus[busind].pb_type = PBT_GONE;
+		pcibus[busind].pb_needinit = 0;
+		pcibus[busind].pb_devind = -1;
+	}
+
+	if (ra_seeded) {
+		for (i = 0; i < pcidev[devind].pd_bar_nr; i++) {
+			bp = &pcidev[devind].pd_bar[i];
+			if (bp->pb_flags & PBF_INCOMPLETE)
+				continue;
+			res_release(pcidev[devind].pd_busind,
+				(bp->pb_flags & PBF_IO) != 0, bp->pb_base,
+				bp->pb_size);
+		}
+	}
+
+	pci_bus_unlink(pcidev[devind].pd_busind, devind);
+	pci_index_del(devind);
+	pciid[devind].pi_flags |= PIF_GONE;
+	pcidev[devind].pd_bar_nr = 0;
+	pcidev[devind].pd_inuse = 0;
+	pcidev[devind].pd_tag = (pcidev[devind].pd_tag + 1) & PCI_TAG_MASK;
+	pcidev[devind].pd_next = pci_free_dev;
+	pci_free_dev = devind;
+	shadow_reset(devind, 0);
+	pci_generation++;
 }
 
 static const char *pci_vid_name(u16_t vid)
@@ -486,6 +1756,52 @@ static const char *pci_vid_name(u16_t vid)
 }
 
 
+/*===========================================================================*
+ *				pci_find_cap				     *
+ *===========================================================================*/
+static int pci_find_cap(int devind, int id)
+{
+    u8_t capptr;
+    int i;
+
+    if (!(__pci_attr_r16(devind, PCI_SR) & PSR_CAPPTR))
+        return 0;
+
+    capptr = __pci_attr_r8(devind, PCI_CAPPTR) & PCI_CP_MASK;
+    for (i = 0; capptr != 0 && i < 48; i++) {
+        if (__pci_attr_r8(devind, capptr + CAP_TYPE) == id)
+            return capptr;
+        capptr = __pci_attr_r8(devind, capptr + CAP_NEXT) & PCI_CP_MASK;
+    }
+    return 0;
+}
+
+/*===========================================================================*
+ *				pci_find_ecap				     *
+ *===========================================================================*/
+static int pci_find_ecap(int devind, int id)
+{
+    int busind, off, i;
+    u32_t v;
+
+    busind = get_busind(pciid[devind].pi_busnr);
+    if (busind < 0 || pcibus[busind].pb_cfgsize < PCI_EXT_CFG_SIZE)
+        return 0;
+
+    off = PCI_CFG_SIZE;
+    for (i = 0; off != 0 && i < (PCI_EXT_CFG_SIZE - PCI_CFG_SIZE) / 8; i++) {
+        v = __pci_attr_r32(devind, off);
+        if (v == 0 || v == 0xffffffff)
+            return 0;
+        if ((int)(v & 0xffff) == id)
+            return off;
+        off = (v >> 20) & 0xffc;
+        if (off < PCI_CFG_SIZE)
+            return 0;
+    }
+    return 0;
+}
+
 static void print_hyper_cap(int devind, u8_t capptr)
 {
     u32_t v;
@@ -572,39 +1888,6 @@ static void print_capabilities(int devind)
 /*===========================================================================*
  *				ISA Bridge Helpers			     *
  *===========================================================================*/
-static void update_bridge4dev_io(int devind, u32_t io_base, u32_t io_size)
-{
-    int busnr, busind, type, br_devind;
-    u16_t v16;
-
-    busnr = pcidev[devind].pd_busnr;
-    busind = get_busind(busnr);
-    type = pcibus[busind].pb_type;
-
-    if (type == PBT_INTEL_HOST || type == PBT_PCIBRIDGE) {
-        if (type == PBT_PCIBRIDGE) {
-            printf("update_bridge4dev_io: not implemented for PCI bridges\n");
-        }
-        return;
-    }
-
-    if (type != PBT_CARDBUS) {
-        panic("update_bridge4dev_io: strange bus type: %d", type);
-    }
-
-    if (debug) {
-        printf("update_bridge4dev_io: adding 0x%x at 0x%x\n",
-               io_size, io_base);
-    }
-
-    br_devind = pcibus[busind].pb_devind;
-    __pci_attr_w32(br_devind, CBB_IOLIMIT_0, io_base + io_size - 1);
-    __pci_attr_w32(br_devind, CBB_IOBASE_0, io_base);
-
-    v16 = __pci_attr_r16(devind, PCI_CR);
-    __pci_attr_w16(devind, PCI_CR, (u16_t)(v16 | PCI_CR_IO_EN | PCI_CR_MAST_EN));
-}
-
 static int do_piix(int devind)
 {
     int i, irqrc, irq;
@@ -616,12 +1899,14 @@ static int do_piix(int devind)
 #endif
 
     s = sys_inb(PIIX_ELCR1, &elcr1);
+    STAT_KCALL(s);
     if (s != OK) {
         fprintf(stderr, "Warning, sys_inb failed: %d\n", s);
         return s;
     }
 
     s = sys_inb(PIIX_ELCR2, &elcr2);
+    STAT_KCALL(s);
     if (s != OK) {
         fprintf(stderr, "Warning, sys_inb failed: %d\n", s);
         return s;
@@ -657,18 +1942,21 @@ static int do_amd_isabr(int devind)
 	u16_t pciirq;
 
 	func = AMD_ISABR_FUNC;
-	busnr = pcidev[devind].pd_busnr;
-	dev = pcidev[devind].pd_dev;
-
-	if (nr_pcidev >= NR_PCIDEV)
-		panic("too many PCI devices: %d", nr_pcidev);
+	busnr = pciid[devind].pi_busnr;
+	dev = pciid[devind].pi_dev;
 
+	pci_reserve_dev(nr_pcidev);
 	xdevind = nr_pcidev++;
-	pcidev[xdevind].pd_busnr = busnr;
-	pcidev[xdevind].pd_dev = dev;
-	pcidev[xdevind].pd_func = func;
+	pciid[xdevind].pi_busnr = busnr;
+	pcidev[xdevind].pd_busind = pcidev[devind].pd_busind;
+	pciid[xdevind].pi_dev = dev;
+	pciid[xdevind].pi_func = func;
 	pcidev[xdevind].pd_inuse = 1;
+	shadow_reset(xdevind, 0);
 
+	/* xdevind is only a handle for the accessors. Function 3 may have
+	 * been enumerated as a device of its own, so leave the index alone.
+	 */
 	levmask = __pci_attr_r8(xdevind, AMD_ISABR_PCIIRQ_LEV);
 	pciirq = __pci_attr_r16(xdevind, AMD_ISABR_PCIIRQ_ROUTE);
 
@@ -761,26 +2049,21 @@ static int do_via_isabr(int devind) {
 
 static int do_isabridge(int busind)
 {
-    int i, j, r = 0, type = 0, busnr, bridge_dev = -1, unknown_bridge = -1;
+    int i, j, r = 0, type = 0, bridge_dev = -1, unknown_bridge = -1;
     u16_t vid = 0, did = 0;
     u32_t t3;
     const char *dstr = NULL;
 
-    busnr = pcibus[busind].pb_busnr;
-
-    for (i = 0; i < nr_pcidev; i++) {
-        if (pcidev[i].pd_busnr != busnr)
-            continue;
-
-        t3 = ((pcidev[i].pd_baseclass << 16) |
-              (pcidev[i].pd_subclass << 8) | pcidev[i].pd_infclass);
+    for (i = pcibus[busind].pb_first_dev; i >= 0; i = pcidev[i].pd_next) {
+        t3 = ((pciid[i].pi_baseclass << 16) |
+              (pciid[i].pi_subclass << 8) | pciid[i].pi_infclass);
 
         if (t3 == PCI_T3_ISA) {
             unknown_bridge = i;
         }
 
-        vid = pcidev[i].pd_vid;
-        did = pcidev[i].pd_did;
+        vid = pciid[i].pi_vid;
+        did = pciid[i].pi_did;
 
         for (j = 0; pci_isabridge[j].vid != 0; j++) {
             if (pci_isabridge[j].vid != vid)
@@ -836,20 +2119,20 @@ static int do_isabridge(int busind)
 
     if (debug) {
         printf("(warning) unsupported ISA bridge %04X:%04X for bus %d\n",
-               pcidev[unknown_bridge].pd_vid,
-               pcidev[unknown_bridge].pd_did, busind);
+               pciid[unknown_bridge].pi_vid,
+               pciid[unknown_bridge].pi_did, busind);
     }
 
     return 0;
 }
 
-static int derive_irq(struct pcidev *dev, int pin)
+static int derive_irq(int devind, int pin)
 {
-    if (!dev || pin < 0) {
+    if (pin < 0) {
         return -1;
     }
 
-    int bus_index = get_busind(dev->pd_busnr);
+    int bus_index = pcidev[devind].pd_busind;
     if (bus_index < 0) {
         return -1;
     }
@@ -859,16 +2142,10 @@ static int derive_irq(struct pcidev *dev, int pin)
         return -1;
     }
 
-    struct pcidev *parent_bridge = &pcidev[parent_index];
-
-    if (!parent_bridge) {
-        return -1;
-    }
-
-    int slot = (dev->pd_func >> 3) & 0x1f;
+    int slot = (pciid[devind].pi_func >> 3) & 0x1f;
 
-    return acpi_get_irq(parent_bridge->pd_busnr,
-                       parent_bridge->pd_dev, (pin + slot) % 4);
+    return acpi_get_irq(pciid[parent_index].pi_busnr,
+                       pciid[parent_index].pi_dev, (pin + slot) % 4);
 }
 
 static void record_irq(int devind)
@@ -877,10 +2154,11 @@ static void record_irq(int devind)
     int ipr = __pci_attr_r8(devind, PCI_IPR);
 
     if (ipr && machine.apic_enabled) {
-        int irq = acpi_get_irq(pcidev[devind].pd_busnr, pcidev[devind].pd_dev, ipr - 1);
+        pcii_unselect();
+        int irq = acpi_get_irq(pciid[devind].pi_busnr, pciid[devind].pi_dev, ipr - 1);
 
         if (irq < 0)
-            irq = derive_irq(&pcidev[devind], ipr - 1);
+            irq = derive_irq(devind, ipr - 1);
 
         if (irq >= 0) {
             ilr = irq;
@@ -888,16 +2166,16 @@ static void record_irq(int devind)
             if (debug) {
                 printf("PCI: ACPI IRQ %d for device %d.%d.%d INT%c\n",
                        irq,
-                       pcidev[devind].pd_busnr,
-                       pcidev[devind].pd_dev,
-                       pcidev[devind].pd_func,
+                       pciid[devind].pi_busnr,
+                       pciid[devind].pi_dev,
+                       pciid[devind].pi_func,
                        'A' + ipr - 1);
             }
         } else if (debug) {
             printf("PCI: no ACPI IRQ routing for device %d.%d.%d INT%c\n",
-                   pcidev[devind].pd_busnr,
-                   pcidev[devind].pd_dev,
-                   pcidev[devind].pd_func,
+                   pciid[devind].pi_busnr,
+                   pciid[devind].pi_dev,
+                   pciid[devind].pi_func,
                    'A' + ipr - 1);
         }
     }
@@ -920,12 +2198,12 @@ static void record_irq(int devind)
         return;
     } else if (ilr != PCI_ILR_UNKNOWN) {
         printf("PCI: IRQ %d is assigned, but device %d.%d.%d does not need it\n",
-               ilr, pcidev[devind].pd_busnr, pcidev[devind].pd_dev,
-               pcidev[devind].pd_func);
+               ilr, pciid[devind].pi_busnr, pciid[devind].pi_dev,
+               pciid[devind].pi_func);
         return;
     }
 
-    int busnr = pcidev[devind].pd_busnr;
+    int busnr = pciid[devind].pi_busnr;
     int busind = get_busind(busnr);
     if (pcibus[busind].pb_type == PBT_CARDBUS) {
         int cb_devind = pcibus[busind].pb_devind;
@@ -941,8 +2219,8 @@ static void record_irq(int devind)
     }
     if (debug) {
         printf("PCI: device %d.%d.%d uses INT%c but is not assigned any IRQ\n",
-               pcidev[devind].pd_busnr, pcidev[devind].pd_dev,
-               pcidev[devind].pd_func, 'A' + ipr - 1);
+               pciid[devind].pi_busnr, pciid[devind].pi_dev,
+               pciid[devind].pi_func, 'A' + ipr - 1);
     }
 }
 
@@ -951,22 +2229,28 @@ static void record_irq(int devind)
  *===========================================================================*/
 static int record_bar(int devind, int bar_nr, int last) {
     int reg, prefetch, type, dev_bar_nr, width = 1;
-    u32_t bar, bar2;
+    u32_t bar, bar2, bar_high, bar2_high;
+    u64_t base, size;
     u16_t cmd;
 
     reg = PCI_BAR + 4 * bar_nr;
 
     bar = __pci_attr_r32(devind, reg);
 
+    /* The command register is written as a dword so that the sizing
+     * sequence can be queued as one batch. The upper half is the status
+     * register, whose bits are read-only or write-one-to-clear, so
+     * writing zeroes there has no effect.
+     */
     if (bar & PCI_BAR_IO) {
         cmd = __pci_attr_r16(devind, PCI_CR);
-        __pci_attr_w16(devind, PCI_CR, (u16_t)(cmd & ~PCI_CR_IO_EN));
+        __pci_attr_w32(devind, PCI_CR, (u16_t)(cmd & ~PCI_CR_IO_EN));
 
         __pci_attr_w32(devind, reg, 0xffffffffU);
         bar2 = __pci_attr_r32(devind, reg);
 
         __pci_attr_w32(devind, reg, bar);
-        __pci_attr_w16(devind, PCI_CR, cmd);
+        __pci_attr_w32(devind, PCI_CR, cmd);
 
         bar &= PCI_BAR_IO_MASK;
         bar2 &= PCI_BAR_IO_MASK;
@@ -991,20 +2275,13 @@ static int record_bar(int devind, int bar_nr, int last) {
     if (type == PCI_TYPE_64) {
         if (last) {
             printf("PCI: device %d.%d.%d BAR %d extends beyond designated area\n",
-                pcidev[devind].pd_busnr,
-                pcidev[devind].pd_dev,
-                pcidev[devind].pd_func, bar_nr);
+                pciid[devind].pi_busnr,
+                pciid[devind].pi_dev,
+                pciid[devind].pi_func, bar_nr);
             return width;
         }
         width++;
-        bar2 = __pci_attr_r32(devind, reg + 4);
-
-        if (bar2 != 0) {
-            if (debug) {
-                printf("\tbar_%d: (64-bit BAR with high bits set)\n", bar_nr);
-            }
-            return width;
-        }
+        bar_high = __pci_attr_r32(devind, reg + 4);
     } else if (type != PCI_TYPE_32 && type != PCI_TYPE_32_1M) {
         if (debug) {
             printf("\tbar_%d: (unknown type %x)\n", bar_nr, type);
@@ -1012,37 +2289,52 @@ static int record_bar(int devind, int bar_nr, int last) {
         return width;
     }
 
+    /* A 64-bit BAR is sized through both registers; a 32-bit one acts
+     * as if its upper half were all ones after sizing and zero before.
+     */
     cmd = __pci_attr_r16(devind, PCI_CR);
-    __pci_attr_w16(devind, PCI_CR, (u16_t)(cmd & ~PCI_CR_MEM_EN));
+    __pci_attr_w32(devind, PCI_CR, (u16_t)(cmd & ~PCI_CR_MEM_EN));
 
     __pci_attr_w32(devind, reg, 0xffffffffU);
+    if (type == PCI_TYPE_64)
+        __pci_attr_w32(devind, reg + 4, 0xffffffffU);
     bar2 = __pci_attr_r32(devind, reg);
+    bar2_high = 0;
+    if (type == PCI_TYPE_64)
+        bar2_high = __pci_attr_r32(devind, reg + 4);
 
     __pci_attr_w32(devind, reg, bar);
-    __pci_attr_w16(devind, PCI_CR, cmd);
+    if (type == PCI_TYPE_64)
+        __pci_attr_w32(devind, reg + 4, bar_high);
+    __pci_attr_w32(devind, PCI_CR, cmd);
 
-    if (bar2 == 0) {
+    if ((bar2 & PCI_BAR_MEM_MASK) == 0 && bar2_high == 0) {
         return width;
     }
+    if (type != PCI_TYPE_64) {
+        bar_high = 0;
+        bar2_high = 0xffffffffU;
+    }
 
     prefetch = (bar & PCI_BAR_PREFETCH) ? 1 : 0;
-    bar &= PCI_BAR_MEM_MASK;
-    bar2 &= PCI_BAR_MEM_MASK;
-    bar2 = (~bar2) + 1U;
+    base = ((u64_t)bar_high << 32) | (bar & PCI_BAR_MEM_MASK);
+    size = ((u64_t)bar2_high << 32) | (bar2 & PCI_BAR_MEM_MASK);
+    size = ~size + 1;
 
     if (debug) {
-        printf("\tbar_%d: 0x%x bytes at 0x%x%s memory%s\n",
-            bar_nr, bar2, bar,
+        printf("\tbar_%d: 0x%llx bytes at 0x%llx%s memory%s\n",
+            bar_nr, (unsigned long long)size, (unsigned long long)base,
             prefetch ? " prefetchable" : "",
             type == PCI_TYPE_64 ? ", 64-bit" : "");
     }
 
     dev_bar_nr = pcidev[devind].pd_bar_nr++;
-    pcidev[devind].pd_bar[dev_bar_nr].pb_flags = 0;
-    pcidev[devind].pd_bar[dev_bar_nr].pb_base = bar;
-    pcidev[devind].pd_bar[dev_bar_nr].pb_size = bar2;
+    pcidev[devind].pd_bar[dev_bar_nr].pb_flags =
+        ((type == PCI_TYPE_64) ? PBF_64 : 0) | (prefetch ? PBF_PREFETCH : 0);
+    pcidev[devind].pd_bar[dev_bar_nr].pb_base = base;
+    pcidev[devind].pd_bar[dev_bar_nr].pb_size = size;
     pcidev[devind].pd_bar[dev_bar_nr].pb_nr = bar_nr;
-    if (bar == 0) {
+    if (base == 0) {
         pcidev[devind].pd_bar[dev_bar_nr].pb_flags |= PBF_INCOMPLETE;
     }
 
@@ -1055,6 +2347,7 @@ static void record_bars(int devind, int last_reg)
     int i = 0;
     int reg = PCI_BAR;
 
+    pci_batch_begin();
     while (reg <= last_reg)
     {
         int is_last = (reg == last_reg);
@@ -1066,6 +2359,7 @@ static void record_bars(int devind, int last_reg)
         i += width;
         reg += 4 * width;
     }
+    pci_batch_end();
 }
 
 static void record_bars_normal(int devind)
@@ -1075,10 +2369,10 @@ static void record_bars_normal(int devind)
 
     record_bars(devind, PCI_BAR_6);
 
-    if (pcidev[devind].pd_baseclass == PCI_BCR_MASS_STORAGE &&
-        pcidev[devind].pd_subclass == PCI_MS_IDE)
+    if (pciid[devind].pi_baseclass == PCI_BCR_MASS_STORAGE &&
+        pciid[devind].pi_subclass == PCI_MS_IDE)
     {
-        if (!(pcidev[devind].pd_infclass & PCI_IDE_PRI_NATIVE))
+        if (!(pciid[devind].pi_infclass & PCI_IDE_PRI_NATIVE))
         {
             if (debug)
             {
@@ -1086,7 +2380,7 @@ static void record_bars_normal(int devind)
             }
             clear_01 = 1;
         }
-        if (!(pcidev[devind].pd_infclass & PCI_IDE_SEC_NATIVE))
+        if (!(pciid[devind].pi_infclass & PCI_IDE_SEC_NATIVE))
         {
             if (debug)
             {
@@ -1119,378 +2413,959 @@ static void record_bars_normal(int devind)
 
 static void record_bars_bridge(int devind)
 {
-    u32_t base, limit, size;
-
+    /* The forwarding windows are read by record_windows, once the bus
+     * behind the bridge has a table entry.
+     */
     record_bars(devind, PCI_BAR_2);
+}
 
-    base = ((__pci_attr_r8(devind, PPB_IOBASE) & PPB_IOB_MASK) << 8) |
-           (__pci_attr_r16(devind, PPB_IOBASEU16) << 16);
+static u32_t compute_limit(u32_t raw_limit, u32_t mask) {
+    return raw_limit | (~mask & 0xffffffff);
+}
 
-    limit = ((__pci_attr_r8(devind, PPB_IOLIMIT) & PPB_IOL_MASK) << 8) |
-            (__pci_attr_r16(devind, PPB_IOLIMITU16) << 16) | 0xff;
+static void record_bars_cardbus(int devind)
+{
+    record_bars(devind, PCI_BAR);
+}
 
-    size = (limit >= base) ? (limit - base + 1) : 0;
+/*===========================================================================*
+ *				Bridge windows				     *
+ *===========================================================================*/
+static const char *const win_name[PBW_NR] = {
+	"I/O", "memory", "prefetchable memory"
+};
 
-    if (debug)
-    {
-        printf("\tI/O window: base 0x%x, limit 0x%x, size %u\n",
-               base, limit, size);
-    }
+static u64_t win_gran(int busind, int w)
+{
+	if (pcibus[busind].pb_type == PBT_CARDBUS)
+		return w == PBW_IO ? CBB_IO_GRAN : CBB_MEM_GRAN;
+	return w == PBW_IO ? PPB_IO_GRAN : PPB_MEM_GRAN;
+}
 
-    base = (__pci_attr_r16(devind, PPB_MEMBASE) & PPB_MEMB_MASK) << 16;
+/* The window of busind that holds space of class w. Prefetchable space
+ * may always live in a non-prefetchable window.
+ */
+static int win_class(int busind, int w)
+{
+	if (w == PBW_PFMEM &&
+		!(pcibus[busind].pb_win[PBW_PFMEM].pw_flags & PWF_PRESENT))
+		return PBW_MEM;
+	return w;
+}
 
-    limit = ((__pci_attr_r16(devind, PPB_MEMLIMIT) & PPB_MEML_MASK) << 16) | 0xffff;
+static int bar_win(int busind, const struct bar *bp)
+{
+	if (bp->pb_flags & PBF_IO)
+		return PBW_IO;
+	return win_class(busind,
+		(bp->pb_flags & PBF_PREFETCH) ? PBW_PFMEM : PBW_MEM);
+}
 
-    size = (limit >= base) ? (limit - base + 1) : 0;
+static u64_t bar_req_size(const struct bar *bp)
+{
+	if (!(bp->pb_flags & PBF_IO) && bp->pb_size < PAGE_SIZE)
+		return PAGE_SIZE;
+	return bp->pb_size;
+}
 
-    if (debug)
-    {
-        printf("\tMemory window: base 0x%x, limit 0x%x, size 0x%x\n",
-               base, limit, size);
-    }
+/*===========================================================================*
+ *				win_probe				     *
+ *===========================================================================*/
+static int win_probe(int devind, int port, u16_t probe)
+{
+	u16_t v;
 
-    base = (__pci_attr_r16(devind, PPB_PFMEMBASE) & PPB_PFMEMB_MASK) << 16;
+	/* Optional windows read as zero when absent. One that reads as zero
+	 * may also just be unassigned, so see if a base sticks. Base 0 with
+	 * limit 0 is not closed but open over the first granule (0x0000-
+	 * 0x0fff for I/O); the probe value does close it for the moment,
+	 * and record_windows closes what stays unassigned.
+	 */
+	if (__pci_attr_r16(devind, port) != 0)
+		return 1;
+	__pci_attr_w16(devind, port, probe);
+	v = __pci_attr_r16(devind, port);
+	__pci_attr_w16(devind, port, 0);
+	return v != 0;
+}
 
-    limit = ((__pci_attr_r16(devind, PPB_PFMEMLIMIT) & PPB_PFMEML_MASK) << 16) | 0xffff;
+/*===========================================================================*
+ *				win_close				     *
+ *===========================================================================*/
+static void win_close(int busind, int w)
+{
+	int devind;
 
-    size = (limit >= base) ? (limit - base + 1) : 0;
+	/* Make window w of busind forward nothing until it is assigned: a
+	 * base above the limit. Zeroes in both would forward the bottom of
+	 * the address space.
+	 */
+	devind = pcibus[busind].pb_devind;
+	if (pcibus[busind].pb_type == PBT_CARDBUS) {
+		switch (w) {
+		case PBW_IO:
+			__pci_attr_w32(devind, CBB_IOBASE_0, CBB_IOL_MASK);
+			__pci_attr_w32(devind, CBB_IOLIMIT_0, 0);
+			break;
+		case PBW_MEM:
+			__pci_attr_w32(devind, CBB_MEMBASE_0, CBB_MEML_MASK);
+			__pci_attr_w32(devind, CBB_MEMLIMIT_0, 0);
+			break;
+		case PBW_PFMEM:
+			__pci_attr_w32(devind, CBB_MEMBASE_1, CBB_MEML_MASK);
+			__pci_attr_w32(devind, CBB_MEMLIMIT_1, 0);
+			break;
+		}
+		return;
+	}
 
-    if (debug)
-    {
-        printf("\tPrefetchable memory window: base 0x%x, limit 0x%x, size 0x%x\n",
-               base, limit, size);
-    }
+	switch (w) {
+	case PBW_IO:
+		__pci_attr_w16(devind, PPB_IOBASEU16, 0);
+		__pci_attr_w16(devind, PPB_IOLIMITU16, 0);
+		__pci_attr_w8(devind, PPB_IOBASE, PPB_IOB_MASK);
+		__pci_attr_w8(devind, PPB_IOLIMIT, 0);
+		break;
+	case PBW_MEM:
+		__pci_attr_w16(devind, PPB_MEMBASE, PPB_MEMB_MASK);
+		__pci_attr_w16(devind, PPB_MEMLIMIT, 0);
+		break;
+	case PBW_PFMEM:
+		if (pcibus[busind].pb_win[w].pw_flags & PWF_64) {
+			__pci_attr_w32(devind, PPB_PFBASE_HI, 0);
+			__pci_attr_w32(devind, PPB_PFLIMIT_HI, 0);
+		}
+		__pci_attr_w16(devind, PPB_PFMEMBASE, PPB_PFMEMB_MASK);
+		__pci_attr_w16(devind, PPB_PFMEMLIMIT, 0);
+		break;
+	}
 }
 
-static void print_window_info(const char *label, u32_t base, u32_t limit, u32_t size) {
-    if (debug) {
-        printf("%s: base 0x%x, limit 0x%x, size %u\n", label, base, limit, size);
-    }
-}
+/*===========================================================================*
+ *				record_windows				     *
+ *===========================================================================*/
+static void record_windows(int busind)
+{
+	struct pci_win *win;
+	int devind, w;
+	u32_t v;
+	u64_t base[PBW_NR], limit[PBW_NR];
+
+	/* Read the windows the bridge of busind forwards. One whose limit is
+	 * below its base, or that starts at 0, is not assigned; complete_bars
+	 * sizes and places those.
+	 */
+	devind = pcibus[busind].pb_devind;
+	win = pcibus[busind].pb_win;
+
+	if (pcibus[busind].pb_type == PBT_CARDBUS) {
+		/* Memory window 1 takes prefetchable BARs, but is not
+		 * marked prefetchable in the bridge control register.
+		 */
+		base[PBW_IO] = __pci_attr_r32(devind, CBB_IOBASE_0);
+		limit[PBW_IO] = compute_limit(
+			__pci_attr_r32(devind, CBB_IOLIMIT_0), CBB_IOL_MASK);
+		base[PBW_MEM] = __pci_attr_r32(devind, CBB_MEMBASE_0);
+		limit[PBW_MEM] = compute_limit(
+			__pci_attr_r32(devind, CBB_MEMLIMIT_0), CBB_MEML_MASK);
+		base[PBW_PFMEM] = __pci_attr_r32(devind, CBB_MEMBASE_1);
+		limit[PBW_PFMEM] = compute_limit(
+			__pci_attr_r32(devind, CBB_MEMLIMIT_1), CBB_MEML_MASK);
+		for (w = 0; w < PBW_NR; w++)
+			win[w].pw_flags = PWF_PRESENT;
+	} else {
+		v = __pci_attr_r8(devind, PPB_IOBASE);
+		base[PBW_IO] = ((v & PPB_IOB_MASK) << 8) |
+			((u32_t)__pci_attr_r16(devind, PPB_IOBASEU16) << 16);
+		limit[PBW_IO] =
+			((__pci_attr_r8(devind, PPB_IOLIMIT) & PPB_IOL_MASK) << 8) |
+			((u32_t)__pci_attr_r16(devind, PPB_IOLIMITU16) << 16) |
+			(PPB_IO_GRAN - 1);
+		if (win_probe(devind, PPB_IOBASE, 0x00f0))
+			win[PBW_IO].pw_flags = PWF_PRESENT;
+
+		base[PBW_MEM] = (u32_t)(__pci_attr_r16(devind, PPB_MEMBASE) &
+			PPB_MEMB_MASK) << 16;
+		limit[PBW_MEM] = ((u32_t)(__pci_attr_r16(devind, PPB_MEMLIMIT) &
+			PPB_MEML_MASK) << 16) | (PPB_MEM_GRAN - 1);
+		win[PBW_MEM].pw_flags = PWF_PRESENT;
+
+		v = __pci_attr_r16(devind, PPB_PFMEMBASE);
+		base[PBW_PFMEM] = (u64_t)(v & PPB_PFMEMB_MASK) << 16;
+		limit[PBW_PFMEM] = ((u64_t)(__pci_attr_r16(devind,
+			PPB_PFMEMLIMIT) & PPB_PFMEML_MASK) << 16) |
+			(PPB_MEM_GRAN - 1);
+		if ((v & ~PPB_PFMEMB_MASK) == 1) {
+			win[PBW_PFMEM].pw_flags = PWF_64;
+			base[PBW_PFMEM] |= (u64_t)__pci_attr_r32(devind,
+				PPB_PFBASE_HI) << 32;
+			limit[PBW_PFMEM] |= (u64_t)__pci_attr_r32(devind,
+				PPB_PFLIMIT_HI) << 32;
+		}
+		if (win_probe(devind, PPB_PFMEMBASE, PPB_PFMEMB_MASK))
+			win[PBW_PFMEM].pw_flags |= PWF_PRESENT;
+	}
 
-static u32_t compute_limit(u32_t raw_limit, u32_t mask) {
-    return raw_limit | (~mask & 0xffffffff);
+	for (w = 0; w < PBW_NR; w++) {
+		if (!(win[w].pw_flags & PWF_PRESENT))
+			continue;
+		if (base[w] != 0 && limit[w] > base[w]) {
+			win[w].pw_base = base[w];
+			win[w].pw_size = limit[w] - base[w] + 1;
+		} else {
+			win_close(busind, w);
+		}
+		if (debug) {
+			printf("\t%s window: base 0x%llx, size 0x%llx\n",
+				win_name[w], (unsigned long long)win[w].pw_base,
+				(unsigned long long)win[w].pw_size);
+		}
+	}
 }
 
-static void record_bars_cardbus(int devind)
+/*===========================================================================*
+ *				win_seed				     *
+ *===========================================================================*/
+static void win_seed(int busind, int w)
 {
-    u32_t base, limit, size;
+	struct pci_win *wp;
 
-    record_bars(devind, PCI_BAR);
+	/* Window w of busind is assigned. Take it out of the window above
+	 * and make its range the free space behind it.
+	 */
+	wp = &pcibus[busind].pb_win[w];
+	ra_reserve(res_pool(win_parent(busind), w == PBW_IO, wp->pw_base),
+		wp->pw_base, wp->pw_size);
+	ra_free(&wp->pw_free, wp->pw_base, wp->pw_size);
+	wp->pw_flags |= PWF_SEEDED;
+}
 
-    base = __pci_attr_r32(devind, CBB_MEMBASE_0);
-    limit = compute_limit(__pci_attr_r32(devind, CBB_MEMLIMIT_0), CBB_MEML_MASK);
-    size = limit > base ? (limit - base + 1) : 0;
-    print_window_info("\tMemory window 0", base, limit, size);
+/*===========================================================================*
+ *				win_program				     *
+ *===========================================================================*/
+static void win_program(int busind, int w)
+{
+	struct pci_win *wp;
+	int devind;
+	u64_t base, limit;
+	u16_t cr;
+
+	wp = &pcibus[busind].pb_win[w];
+	devind = pcibus[busind].pb_devind;
+	base = wp->pw_base;
+	limit = wp->pw_base + wp->pw_size - 1;
 
-    base = __pci_attr_r32(devind, CBB_MEMBASE_1);
-    limit = compute_limit(__pci_attr_r32(devind, CBB_MEMLIMIT_1), CBB_MEML_MASK);
-    size = limit > base ? (limit - base + 1) : 0;
-    print_window_info("\tMemory window 1", base, limit, size);
+	if (debug) {
+		printf("PCI: bus %d %s window [0x%llx..0x%llx]\n",
+			pcibus[busind].pb_busnr, win_name[w],
+			(unsigned long long)base, (unsigned long long)limit);
+	}
 
-    base = __pci_attr_r32(devind, CBB_IOBASE_0);
-    limit = compute_limit(__pci_attr_r32(devind, CBB_IOLIMIT_0), CBB_IOL_MASK);
-    size = limit > base ? (limit - base + 1) : 0;
-    print_window_info("\tI/O window 0", base, limit, size);
+	if (pcibus[busind].pb_type == PBT_CARDBUS) {
+		switch (w) {
+		case PBW_IO:
+			__pci_attr_w32(devind, CBB_IOBASE_0, base);
+			__pci_attr_w32(devind, CBB_IOLIMIT_0, limit);
+			break;
+		case PBW_MEM:
+			__pci_attr_w32(devind, CBB_MEMBASE_0, base);
+			__pci_attr_w32(devind, CBB_MEMLIMIT_0, limit);
+			break;
+		case PBW_PFMEM:
+			__pci_attr_w32(devind, CBB_MEMBASE_1, base);
+			__pci_attr_w32(devind, CBB_MEMLIMIT_1, limit);
+			break;
+		}
+	} else {
+		switch (w) {
+		case PBW_IO:
+			__pci_attr_w16(devind, PPB_IOBASEU16, base >> 16);
+			__pci_attr_w16(devind, PPB_IOLIMITU16, limit >> 16);
+			__pci_attr_w8(devind, PPB_IOBASE,
+				(base >> 8) & PPB_IOB_MASK);
+			__pci_attr_w8(devind, PPB_IOLIMIT,
+				(limit >> 8) & PPB_IOL_MASK);
+			break;
+		case PBW_MEM:
+			__pci_attr_w16(devind, PPB_MEMBASE,
+				(base >> 16) & PPB_MEMB_MASK);
+			__pci_attr_w16(devind, PPB_MEMLIMIT,
+				(limit >> 16) & PPB_MEML_MASK);
+			break;
+		case PBW_PFMEM:
+			if (wp->pw_flags & PWF_64) {
+				__pci_attr_w32(devind, PPB_PFBASE_HI, base >> 32);
+				__pci_attr_w32(devind, PPB_PFLIMIT_HI,
+					limit >> 32);
+			}
+			__pci_attr_w16(devind, PPB_PFMEMBASE,
+				(base >> 16) & PPB_PFMEMB_MASK);
+			__pci_attr_w16(devind, PPB_PFMEMLIMIT,
+				(limit >> 16) & PPB_PFMEML_MASK);
+			break;
+		}
+	}
 
-    base = __pci_attr_r32(devind, CBB_IOBASE_1);
-    limit = compute_limit(__pci_attr_r32(devind, CBB_IOLIMIT_1), CBB_IOL_MASK);
-    size = limit > base ? (limit - base + 1) : 0;
-    print_window_info("\tI/O window 1", base, limit, size);
+	cr = __pci_attr_r16(devind, PCI_CR);
+	cr |= (w == PBW_IO ? PCI_CR_IO_EN : PCI_CR_MEM_EN) | PCI_CR_MAST_EN;
+	__pci_attr_w16(devind, PCI_CR, cr);
 }
 
-static void complete_bars(void)
+/*===========================================================================*
+ *				win_add					     *
+ *===========================================================================*/
+static void win_add(int busind, int w, u64_t size, u64_t align, int low)
 {
-	int i, j, bar_nr, reg;
-	u32_t memgap_low, memgap_high, iogap_low, iogap_high, io_high;
-	u32_t base, size, v32, diff1, diff2;
-	kinfo_t kinfo;
+	struct pci_win *wp;
 
-	if (sys_getkinfo(&kinfo) != OK) {
-		panic("can't get kinfo");
-	}
+	/* Count size bytes at the given alignment against window w of
+	 * busind, if that window still has to be placed.
+	 */
+	if (pcibus[busind].pb_type == PBT_INTEL_HOST)
+		return;
+	wp = &pcibus[busind].pb_win[w];
+	if (!(wp->pw_flags & PWF_PRESENT) || (wp->pw_flags & PWF_SEEDED))
+		return;
 
-	memgap_low = kinfo.mem_high_phys;
-	memgap_high = 0xfe000000;
+	wp->pw_need += (size + align - 1) & ~(align - 1);
+	if (align > wp->pw_align)
+		wp->pw_align = align;
+	if (low)
+		wp->pw_flags |= PWF_LOW;
+}
 
-	if (debug) {
-		printf("complete_bars: initial gap: [0x%x .. 0x%x>\n", memgap_low, memgap_high);
+/*===========================================================================*
+ *				win_size				     *
+ *===========================================================================*/
+static void win_size(void)
+{
+	struct pci_win *wp;
+	struct bar *bp;
+	int i, j, w, parent;
+	u64_t gran;
+
+	/* Work out bottom-up how large each unassigned window must be: the
+	 * BARs behind it that still need space, plus the windows of the
+	 * bridges below it, each padded to its own alignment. Packed in
+	 * order of decreasing alignment these fit without gaps. Children
+	 * always come after their parent in pcibus[], so a backward pass
+	 * sees every window before the one that contains it.
+	 */
+	for (i = 0; i < nr_pcibus; i++) {
+		for (w = 0; w < PBW_NR; w++) {
+			wp = &pcibus[i].pb_win[w];
+			wp->pw_need = 0;
+			wp->pw_align = win_gran(i, w);
+			wp->pw_flags &= ~PWF_LOW;
+		}
 	}
 
 	for (i = 0; i < nr_pcidev; i++) {
+		if ((pciid[i].pi_flags & (PIF_GONE | PIF_NEW)) != PIF_NEW)
+			continue;
 		for (j = 0; j < pcidev[i].pd_bar_nr; j++) {
-			if ((pcidev[i].pd_bar[j].pb_flags & PBF_IO) ||
-			    (pcidev[i].pd_bar[j].pb_flags & PBF_INCOMPLETE)) {
+			bp = &pcidev[i].pd_bar[j];
+			if (!(bp->pb_flags & PBF_INCOMPLETE))
 				continue;
-			}
-			base = pcidev[i].pd_bar[j].pb_base;
-			size = pcidev[i].pd_bar[j].pb_size;
+			win_add(pcidev[i].pd_busind,
+				bar_win(pcidev[i].pd_busind, bp),
+				bar_req_size(bp), bar_req_size(bp),
+				!(bp->pb_flags & PBF_64));
+		}
+	}
 
-			if (base >= memgap_high || base + size <= memgap_low) {
+	for (i = nr_pcibus - 1; i >= 0; i--) {
+		if (pcibus[i].pb_type != PBT_PCIBRIDGE &&
+			pcibus[i].pb_type != PBT_CARDBUS)
+			continue;
+		parent = win_parent(i);
+		for (w = 0; w < PBW_NR; w++) {
+			wp = &pcibus[i].pb_win[w];
+			if (!(wp->pw_flags & PWF_PRESENT) ||
+				(wp->pw_flags & PWF_SEEDED))
+				continue;
+			if (pcibus[i].pb_type == PBT_CARDBUS && w == PBW_IO &&
+				wp->pw_need < CBB_IO_MIN)
+				wp->pw_need = CBB_IO_MIN;
+			if (pcibus[i].pb_type == PBT_CARDBUS && w == PBW_MEM &&
+				wp->pw_need < CBB_MEM_MIN)
+				wp->pw_need = CBB_MEM_MIN;
+			if (wp->pw_need == 0)
 				continue;
-			}
 
-			diff1 = base + size - memgap_low;
-			diff2 = memgap_high - base;
+			gran = win_gran(i, w);
+			wp->pw_need = (wp->pw_need + gran - 1) & ~(gran - 1);
+			if (w != PBW_PFMEM || !(wp->pw_flags & PWF_64))
+				wp->pw_flags |= PWF_LOW;
+			win_add(parent, win_class(parent, w), wp->pw_need,
+				wp->pw_align, wp->pw_flags & PWF_LOW);
+		}
+	}
+}
 
-			if (diff1 < diff2) {
-				memgap_low = base + size;
-			} else {
-				memgap_high = base;
-			}
+static int bar_req_cmp(const void *a, const void *b)
+{
+	const struct bar_req *x = a, *y = b;
+
+	/* Parents first, so a window is placed before what goes in it;
+	 * then by decreasing alignment and size.
+	 */
+	if (x->br_busind != y->br_busind)
+		return x->br_busind - y->br_busind;
+	if (x->br_align != y->br_align)
+		return x->br_align > y->br_align ? -1 : 1;
+	if (x->br_size != y->br_size)
+		return x->br_size > y->br_size ? -1 : 1;
+	if (x->br_devind != y->br_devind)
+		return x->br_devind - y->br_devind;
+	if (x->br_child != y->br_child)
+		return x->br_child - y->br_child;
+	return x->br_bar - y->br_bar;
+}
+
+/*===========================================================================*
+ *				pci_get_window				     *
+ *===========================================================================*/
+static int pci_get_window(int idx, int *iop, u64_t *basep, u64_t *sizep)
+{
+	/* Return the idx'th resource window of the host bridge, as found in
+	 * its ACPI _CRS, or ENOENT past the last one.
+	 */
+#ifdef PCI_SIM
+	if (pcisim_active())
+		return pcisim_get_window(idx, iop, basep, sizep) == 0 ? OK :
+			ENOENT;
+#endif
+#if PCI_CRS
+	if (!machine.apic_enabled)
+		return ENOENT;
+
+	pcii_unselect();
+	return acpi_get_crs(idx, iop, basep, sizep);
+#else
+	(void)idx;
+	(void)iop;
+	(void)basep;
+	(void)sizep;
+	return ENOENT;
+#endif
+}
+
+/*===========================================================================*
+ *				ra_seed					     *
+ *===========================================================================*/
+static void ra_seed(void)
+{
+	kinfo_t kinfo;
+	u64_t base, size;
+	int i, io, nr_mem, nr_io;
+
+#ifdef PCI_SIM
+	if (pcisim_active()) {
+		kinfo.mem_high_phys = pcisim_mem_high();
+	} else
+#endif
+	if (sys_getkinfo(&kinfo) != OK) {
+		panic("can't get kinfo");
+	}
+
+	/* The host bridge decodes the windows listed in its _CRS; those
+	 * may include large apertures above 4 GB.
+	 */
+	nr_mem = nr_io = 0;
+	for (i = 0; pci_get_window(i, &io, &base, &size) == OK; i++) {
+		if (debug) {
+			printf("PCI: host window %s [0x%llx..0x%llx>\n",
+				io ? "I/O" : "mem", (unsigned long long)base,
+				(unsigned long long)(base + size));
 		}
+		if (size == 0)
+			continue;
+		ra_free(io ? &ra_io : &ra_mem, base, size);
+		if (io)
+			nr_io++;
+		else
+			nr_mem++;
 	}
 
-	if (debug) {
-		printf("complete_bars: intermediate gap: [0x%x .. 0x%x>\n", memgap_low, memgap_high);
+	/* Without _CRS, fall back to what complete_bars always used: the
+	 * hole between the top of RAM and the local APIC. The kernel's
+	 * memory map only lists usable RAM, not what firmware reserved in
+	 * that hole, so there is nothing more to take out.
+	 */
+	if (nr_mem == 0) {
+		ra_free(&ra_mem, kinfo.mem_high_phys,
+			0xfe000000 - kinfo.mem_high_phys);
 	}
+	if (nr_io == 0)
+		ra_free(&ra_io, 0x400, 0x10000 - 0x400);
+
+	/* Never hand out RAM or the legacy I/O range, whatever _CRS says */
+	ra_reserve(&ra_mem, 0, kinfo.mem_high_phys);
+	ra_reserve(&ra_io, 0, 0x400);
 
-	if (memgap_high < memgap_low) {
-		printf("PCI: bad memory gap: [0x%x .. 0x%x>\n", memgap_low, memgap_high);
-		panic(NULL);
+	/* Remember what was seeded; res_release clips to it */
+	for (i = 0; i < ra_mem.ra_nr; i++) {
+		ra_free(&ra_mem_seed, ra_mem.ra_range[i].rr_base,
+			ra_mem.ra_range[i].rr_size);
 	}
+	for (i = 0; i < ra_io.ra_nr; i++) {
+		ra_free(&ra_io_seed, ra_io.ra_range[i].rr_base,
+			ra_io.ra_range[i].rr_size);
+	}
+	ra_seeded = 1;
+}
 
-	iogap_high = 0x10000;
-	iogap_low = 0x400;
+static void bars_done(void)
+{
+	int i, j;
 
+	/* complete_bars is through with the new devices */
 	for (i = 0; i < nr_pcidev; i++) {
+		if (!(pciid[i].pi_flags & PIF_NEW))
+			continue;
+		pciid[i].pi_flags &= ~PIF_NEW;
+		if (pciid[i].pi_flags & PIF_GONE)
+			continue;
 		for (j = 0; j < pcidev[i].pd_bar_nr; j++) {
-			if (!(pcidev[i].pd_bar[j].pb_flags & PBF_IO) ||
-			    (pcidev[i].pd_bar[j].pb_flags & PBF_INCOMPLETE)) {
-				continue;
-			}
-			base = pcidev[i].pd_bar[j].pb_base;
-			size = pcidev[i].pd_bar[j].pb_size;
-			if (base >= iogap_high || base + size <= iogap_low) {
-				continue;
-			}
-			if ((base + size - iogap_low) < (iogap_high - base)) {
-				iogap_low = base + size;
-			} else {
-				iogap_high = base;
+			if (pcidev[i].pd_bar[j].pb_flags & PBF_INCOMPLETE) {
+				printf("should allocate resources for device %d\n", i);
 			}
 		}
 	}
+}
 
-	if (iogap_high < iogap_low) {
-		if (debug) {
-			printf("iogap_high too low, should panic\n");
-		} else {
-			panic("iogap_high too low: %d", iogap_high);
-		}
-	}
+static void complete_bars(void)
+{
+	struct bar_req *req;
+	struct res_alloc *ra;
+	struct pci_win *wp;
+	struct bar *bp;
+	int i, j, w, n, nreq, reg, io, r;
+	u32_t v32;
+	u16_t cr;
+	u64_t base;
+
+	/* Give addresses to the incomplete BARs of the devices probed since
+	 * the last call (PIF_NEW), and to the bridge windows they need. The host bridge windows seed
+	 * ra_mem and ra_io once; assigned bridge windows get a free set of
+	 * their own, taken out of the one above. Complete BARs are taken out
+	 * of whichever set covers them.
+	 *
+	 * Unassigned windows are then sized bottom-up by win_size and
+	 * everything is placed top-down: a bus is handled before the buses
+	 * below it, and on each bus requests go largest alignment first.
+	 * From the host bridge, allocation is top down, so 64-bit BARs and
+	 * 64-bit prefetchable windows land above 4 GB when there is a
+	 * window there.
+	 */
+	if (!ra_seeded)
+		ra_seed();
 
-	if (debug) {
-		printf("I/O range = [0x%x..0x%x>\n", iogap_low, iogap_high);
+	for (i = 0; i < nr_pcibus; i++) {
+		if (pcibus[i].pb_type != PBT_PCIBRIDGE &&
+			pcibus[i].pb_type != PBT_CARDBUS)
+			continue;
+		for (w = 0; w < PBW_NR; w++) {
+			wp = &pcibus[i].pb_win[w];
+			if ((wp->pw_flags & PWF_PRESENT) &&
+				!(wp->pw_flags & PWF_SEEDED) && wp->pw_size != 0)
+				win_seed(i, w);
+		}
 	}
 
+	nreq = 0;
 	for (i = 0; i < nr_pcidev; i++) {
+		if ((pciid[i].pi_flags & (PIF_GONE | PIF_NEW)) != PIF_NEW)
+			continue;
 		for (j = 0; j < pcidev[i].pd_bar_nr; j++) {
-			if ((pcidev[i].pd_bar[j].pb_flags & PBF_IO) ||
-			    !(pcidev[i].pd_bar[j].pb_flags & PBF_INCOMPLETE)) {
+			bp = &pcidev[i].pd_bar[j];
+			if (bp->pb_flags & PBF_INCOMPLETE) {
+				nreq++;
 				continue;
 			}
-			size = pcidev[i].pd_bar[j].pb_size;
-			if (size < PAGE_SIZE) {
-				size = PAGE_SIZE;
-			}
-			base = memgap_high - size;
-			base &= ~(u32_t)(size-1);
-			if (base < memgap_low) {
-				panic("memory base too low: %d", base);
-			}
-			memgap_high = base;
-			bar_nr = pcidev[i].pd_bar[j].pb_nr;
-			reg = PCI_BAR + 4*bar_nr;
-			v32 = __pci_attr_r32(i, reg);
-			__pci_attr_w32(i, reg, (v32 & ~((u32_t)(size - 1))) | base);
+			io = (bp->pb_flags & PBF_IO) != 0;
+			ra_reserve(res_pool(pcidev[i].pd_busind, io, bp->pb_base),
+				bp->pb_base, bp->pb_size);
+		}
+	}
 
-			if (debug) {
-				printf("complete_bars: allocated 0x%x size %d to %d.%d.%d, bar_%d\n",
-					base, size, pcidev[i].pd_busnr,
-					pcidev[i].pd_dev, pcidev[i].pd_func,
-					bar_nr);
-			}
+	if (debug) {
+		ra_print("mem", &ra_mem);
+		ra_print("I/O", &ra_io);
+	}
 
-			pcidev[i].pd_bar[j].pb_base = base;
-			pcidev[i].pd_bar[j].pb_flags &= ~PBF_INCOMPLETE;
+	win_size();
+	for (i = 0; i < nr_pcibus; i++) {
+		for (w = 0; w < PBW_NR; w++) {
+			if (!(pcibus[i].pb_win[w].pw_flags & PWF_SEEDED) &&
+				pcibus[i].pb_win[w].pw_need != 0)
+				nreq++;
 		}
+	}
 
-		io_high = iogap_high;
+	if (nreq == 0) {
+		bars_done();
+		return;
+	}
+
+	req = malloc(nreq * sizeof(*req));
+	if (req == NULL)
+		panic("PCI: complete_bars: out of memory");
+
+	n = 0;
+	for (i = 0; i < nr_pcidev; i++) {
+		if ((pciid[i].pi_flags & (PIF_GONE | PIF_NEW)) != PIF_NEW)
+			continue;
 		for (j = 0; j < pcidev[i].pd_bar_nr; j++) {
-			if (!(pcidev[i].pd_bar[j].pb_flags & PBF_IO) ||
-			    !(pcidev[i].pd_bar[j].pb_flags & PBF_INCOMPLETE)) {
+			bp = &pcidev[i].pd_bar[j];
+			if (!(bp->pb_flags & PBF_INCOMPLETE))
 				continue;
-			}
-			size = pcidev[i].pd_bar[j].pb_size;
-			base = iogap_high - size;
-			base &= ~(u32_t)(size-1);
-
-			base &= 0xfcff;
+			req[n].br_busind = pcidev[i].pd_busind;
+			req[n].br_win = bar_win(pcidev[i].pd_busind, bp);
+			req[n].br_devind = i;
+			req[n].br_bar = j;
+			req[n].br_child = -1;
+			req[n].br_size = req[n].br_align = bar_req_size(bp);
+			req[n].br_limit = (bp->pb_flags & PBF_64) ? ~(u64_t)0 :
+				(u64_t)1 << 32;
+			n++;
+		}
+	}
+	for (i = 0; i < nr_pcibus; i++) {
+		for (w = 0; w < PBW_NR; w++) {
+			wp = &pcibus[i].pb_win[w];
+			if ((wp->pw_flags & PWF_SEEDED) || wp->pw_need == 0)
+				continue;
+			req[n].br_busind = win_parent(i);
+			req[n].br_win = win_class(req[n].br_busind, w);
+			req[n].br_devind = -1;
+			req[n].br_bar = w;
+			req[n].br_child = i;
+			req[n].br_size = wp->pw_need;
+			req[n].br_align = wp->pw_align;
+			if (w == PBW_IO)
+				req[n].br_limit = 0x10000;
+			else if (wp->pw_flags & PWF_LOW)
+				req[n].br_limit = (u64_t)1 << 32;
+			else
+				req[n].br_limit = ~(u64_t)0;
+			n++;
+		}
+	}
+	qsort(req, n, sizeof(*req), bar_req_cmp);
+
+	for (n = 0; n < nreq; n++) {
+		i = req[n].br_devind;
+		io = (req[n].br_win == PBW_IO);
+		ra = win_pool(req[n].br_busind, req[n].br_win);
+		if (ra == NULL) {
+			r = ENOSPC;
+		} else if (pcibus[req[n].br_busind].pb_type == PBT_INTEL_HOST) {
+			r = ra_alloc(ra, req[n].br_size, req[n].br_align,
+				req[n].br_limit, i >= 0 && io &&
+				req[n].br_size <= 0x100, &base);
+		} else {
+			r = ra_alloc_low(ra, req[n].br_size, req[n].br_align,
+				req[n].br_limit, &base);
+		}
 
-			if (base < iogap_low) {
-				printf("I/O base too low: %d\n", base);
+		if (i < 0) {
+			/* A bridge window */
+			j = req[n].br_child;
+			w = req[n].br_bar;
+			if (r != OK) {
+				printf("PCI: no %s space for bus %d (size 0x%llx)\n",
+					win_name[w], pcibus[j].pb_busnr,
+					(unsigned long long)req[n].br_size);
+				continue;
 			}
+			wp = &pcibus[j].pb_win[w];
+			wp->pw_base = base;
+			wp->pw_size = req[n].br_size;
+			win_seed(j, w);
+			win_program(j, w);
+			continue;
+		}
 
-			iogap_high = base;
-			bar_nr = pcidev[i].pd_bar[j].pb_nr;
-			reg = PCI_BAR + 4*bar_nr;
-			v32 = __pci_attr_r32(i, reg);
-			__pci_attr_w32(i, reg, (v32 & ~((u32_t)(size - 1))) | base);
+		bp = &pcidev[i].pd_bar[req[n].br_bar];
+		if (r != OK) {
+			printf("PCI: no %s space for %d.%d.%d, bar_%d (size 0x%llx)\n",
+				io ? "I/O" : "memory", pciid[i].pi_busnr,
+				pciid[i].pi_dev, pciid[i].pi_func, bp->pb_nr,
+				(unsigned long long)req[n].br_size);
+			continue;
+		}
 
-			if (debug) {
-				printf("complete_bars: allocated 0x%x size %d to %d.%d.%d, bar_%d\n",
-					base, size, pcidev[i].pd_busnr,
-					pcidev[i].pd_dev, pcidev[i].pd_func,
-					bar_nr);
-			}
+		reg = PCI_BAR + 4*bp->pb_nr;
+		v32 = __pci_attr_r32(i, reg);
+		v32 &= io ? ~PCI_BAR_IO_MASK : ~PCI_BAR_MEM_MASK;
+		__pci_attr_w32(i, reg, v32 | (u32_t)base);
+		if (bp->pb_flags & PBF_64)
+			__pci_attr_w32(i, reg + 4, (u32_t)(base >> 32));
 
-			pcidev[i].pd_bar[j].pb_base = base;
-			pcidev[i].pd_bar[j].pb_flags &= ~PBF_INCOMPLETE;
+		if (debug) {
+			printf("complete_bars: allocated 0x%llx size 0x%llx to %d.%d.%d, bar_%d\n",
+				(unsigned long long)base,
+				(unsigned long long)req[n].br_size,
+				pciid[i].pi_busnr, pciid[i].pi_dev,
+				pciid[i].pi_func, bp->pb_nr);
 		}
 
-		if (iogap_high != io_high) {
-			update_bridge4dev_io(i, iogap_high, io_high - iogap_high);
-		}
-	}
+		bp->pb_base = base;
+		bp->pb_flags &= ~PBF_INCOMPLETE;
 
-	for (i = 0; i < nr_pcidev; i++) {
-		for (j = 0; j < pcidev[i].pd_bar_nr; j++) {
-			if (pcidev[i].pd_bar[j].pb_flags & PBF_INCOMPLETE) {
-				printf("should allocate resources for device %d\n", i);
-			}
+		/* Cards behind a CardBus bridge get their I/O decoding
+		 * switched on here, as before.
+		 */
+		if (io && pcibus[pcidev[i].pd_busind].pb_type == PBT_CARDBUS) {
+			cr = __pci_attr_r16(i, PCI_CR);
+			__pci_attr_w16(i, PCI_CR,
+				cr | PCI_CR_IO_EN | PCI_CR_MAST_EN);
 		}
 	}
+
+	bars_done();
+	free(req);
 }
 
 /*===========================================================================*
  *				PCI Bridge Helpers			     *
  *===========================================================================*/
-static void probe_bus(int busind) {
-    uint32_t dev, func;
-    u16_t vid, did, sts, sub_vid, sub_did;
+/*===========================================================================*
+ *				probe_func				     *
+ *===========================================================================*/
+static int probe_func(int busind, int dev, int func, int *devindp)
+{
+    u16_t vid, did, sub_vid, sub_did;
     u8_t headt, baseclass, subclass, infclass;
+    u32_t v;
     int devind, busnr;
     const char *s, *dstr;
-    static int warned = 0;
+
+    /* Probe one function. Returns its header type, or -1 if there is
+     * nothing there. *devindp is set to the new device index, or to -1
+     * if the function was already known.
+     */
+    *devindp = -1;
+
+    busnr = pcibus[busind].pb_busnr;
+
+    if (is_duplicate(busnr, dev, func)) {
+        /* Already known, e.g. on a rescan: don't touch it. */
+        return pciid[pci_index_lookup(busnr, dev, func)].pi_headt;
+    }
+
+    /* Take a freed slot if there is one; it stays marked gone, and on
+     * the free list, until the function turns out to exist.
+     */
+    if (pci_free_dev >= 0) {
+        devind = pci_free_dev;
+#if PCI_STATS
+        memset(&pcidev[devind].pd_stat, 0, sizeof(pcidev[devind].pd_stat));
+#endif
+    } else if (nr_pcidev < PCI_DEV_MAX) {
+        devind = nr_pcidev;
+        pci_reserve_dev(devind);
+    } else {
+        printf("PCI: device table full, %d.%d.%d ignored\n",
+            busnr, dev, func);
+        return -1;
+    }
+
+    pciid[devind].pi_busnr = busnr;
+    pcidev[devind].pd_busind = busind;
+    pciid[devind].pi_dev = dev;
+    pciid[devind].pi_func = func;
+    shadow_reset(devind, SHADOW_PROBE);
+
+    /* Read the header a dword at a time and decode it here. */
+    v = __pci_attr_r32(devind, PCI_VID);
+    vid = v & 0xffff;
+    did = v >> 16;
+
+    if (vid == NO_VID && did == NO_VID)
+        return -1;
+
+    v = __pci_attr_r32(devind, PCI_HEADT & ~3);
+    headt = (v >> 16) & 0xff;
+    pcidev[devind].pd_shadow_ok = shadow_mask(headt);
+
+    v = __pci_attr_r32(devind, PCI_SUBVID);
+    sub_vid = v & 0xffff;
+    sub_did = v >> 16;
+
+    v = __pci_attr_r32(devind, PCI_PIFR & ~3);
+    infclass = (v >> 8) & 0xff;
+    subclass = (v >> 16) & 0xff;
+    baseclass = v >> 24;
+
+    if (debug) {
+        dstr = _pci_dev_name(vid, did);
+        if (dstr) {
+            printf("%d.%d.%d: %s (%04X:%04X)\n",
+                busnr, dev, func, dstr, vid, did);
+        } else {
+            printf("%d.%d.%d: Unknown device, vendor %04X (%s), device %04X\n",
+                busnr, dev, func, vid, pci_vid_name(vid), did);
+        }
+        printf("Device index: %d\n", devind);
+        printf("Subsystem: Vid 0x%x, did 0x%x\n", sub_vid, sub_did);
+
+        s = pci_subclass_name((baseclass << 24) | (subclass << 16));
+        if (!s) s = pci_baseclass_name(baseclass << 24);
+        if (!s) s = "(unknown class)";
+        printf("\tclass %s (%X/%X/%X)\n", s, baseclass, subclass, infclass);
+    }
+
+    if (devind == pci_free_dev)
+        pci_free_dev = pcidev[devind].pd_next;
+    else
+        nr_pcidev++;
+    pci_index_add(devind);
+    pci_bus_link(busind, devind);
+    pci_generation++;
+
+    pciid[devind].pi_baseclass = baseclass;
+    pciid[devind].pi_subclass = subclass;
+    pciid[devind].pi_infclass = infclass;
+    pciid[devind].pi_vid = vid;
+    pciid[devind].pi_did = did;
+    pciid[devind].pi_sub_vid = sub_vid;
+    pciid[devind].pi_sub_did = sub_did;
+    pciid[devind].pi_headt = headt;
+    pciid[devind].pi_flags = PIF_NEW;
+    pcidev[devind].pd_inuse = 0;
+    pcidev[devind].pd_bar_nr = 0;
+
+    pci_batch_begin();
+
+    record_irq(devind);
+
+    switch (headt & PHT_MASK) {
+        case PHT_NORMAL:
+            record_bars_normal(devind);
+            break;
+        case PHT_BRIDGE:
+            record_bars_bridge(devind);
+            break;
+        case PHT_CARDBUS:
+            record_bars_cardbus(devind);
+            break;
+        default:
+            printf("\t%d.%d.%d: unknown header type %d\n", busind, dev, func, headt & PHT_MASK);
+            break;
+    }
 
     if (debug)
-        printf("probe_bus(%d)\n", busind);
+        print_capabilities(devind);
 
-    if (nr_pcidev >= NR_PCIDEV)
-        panic("too many PCI devices: %d", nr_pcidev);
+    pci_batch_end();
 
-    busnr = pcibus[busind].pb_busnr;
-    devind = nr_pcidev;
+    *devindp = devind;
+    return headt;
+}
 
-    for (dev = 0; dev < 32; dev++) {
-        for (func = 0; func < 8; func++) {
-            if (nr_pcidev >= NR_PCIDEV)
-                panic("too many PCI devices: %d", nr_pcidev);
+/*===========================================================================*
+ *				probe_ari				     *
+ *===========================================================================*/
+static int probe_ari(int busind, int devind)
+{
+    int cap, fn, count, headt, br_devind, br_cap;
+    u16_t v16;
 
-            pcidev[devind].pd_busnr = busnr;
-            pcidev[devind].pd_dev = dev;
-            pcidev[devind].pd_func = func;
+    /* devind is function 0 of the only device on a point-to-point link.
+     * If it implements ARI, its functions are found by following the
+     * next-function numbers instead of scanning device numbers 1-31.
+     */
+    cap = pci_find_ecap(devind, PCI_ECAP_ARI);
+    if (cap == 0)
+        return 0;
 
-            pci_attr_wsts(devind, PSR_SSE | PSR_RMAS | PSR_RTAS);
-            vid = __pci_attr_r16(devind, PCI_VID);
-            did = __pci_attr_r16(devind, PCI_DID);
-            headt = __pci_attr_r8(devind, PCI_HEADT);
-            sts = pci_attr_rsts(devind);
+    br_devind = pcibus[busind].pb_devind;
+    br_cap = pcibus[busind].pb_pciecap;
+    v16 = __pci_attr_r16(br_devind, br_cap + PCIE_DEVCTL2);
+    if (!(v16 & PCIE_DEVCTL2_ARI))
+        __pci_attr_w16(br_devind, br_cap + PCIE_DEVCTL2, v16 | PCIE_DEVCTL2_ARI);
 
-            if (vid == NO_VID && did == NO_VID) {
-                if (func == 0) break;
-                continue;
-            }
+    if (debug) {
+        printf("PCI: ARI device on bus %d\n", pcibus[busind].pb_busnr);
+    }
 
-            if (sts & (PSR_SSE | PSR_RMAS | PSR_RTAS)) {
-                if (!warned) {
-                    printf("PCI: ignoring bad value 0x%x in sts for QEMU\n", sts & (PSR_SSE | PSR_RMAS | PSR_RTAS));
-                    warned = 1;
-                }
-            }
+    fn = (__pci_attr_r16(devind, cap + PCI_ARI_CAP) >> 8) & 0xff;
+    for (count = 0; fn != 0 && count < 255; count++) {
+        headt = probe_func(busind, fn >> 3, fn & 7, &devind);
+        if (headt < 0)
+            break;
+        if (devind < 0 && !_pci_find_dev(pcibus[busind].pb_busnr,
+            fn >> 3, fn & 7, &devind))
+            break;
 
-            sub_vid = __pci_attr_r16(devind, PCI_SUBVID);
-            sub_did = __pci_attr_r16(devind, PCI_SUBDID);
+        cap = pci_find_ecap(devind, PCI_ECAP_ARI);
+        if (cap == 0)
+            break;
+        fn = (__pci_attr_r16(devind, cap + PCI_ARI_CAP) >> 8) & 0xff;
+    }
+    return 1;
+}
 
-            dstr = _pci_dev_name(vid, did);
+/*===========================================================================*
+ *				probe_bus				     *
+ *===========================================================================*/
+static void probe_bus(int busind) {
+    int dev, func, ndev, headt, devind, busnr;
+    u16_t sts;
+    static int warned = 0;
 
-            if (debug) {
-                if (dstr) {
-                    printf("%d.%lu.%lu: %s (%04X:%04X)\n",
-                        busnr, (unsigned long)dev, (unsigned long)func, dstr, vid, did);
-                } else {
-                    printf("%d.%lu.%lu: Unknown device, vendor %04X (%s), device %04X\n",
-                        busnr, (unsigned long)dev, (unsigned long)func,
-                        vid, pci_vid_name(vid), did);
-                }
-                printf("Device index: %d\n", devind);
-                printf("Subsystem: Vid 0x%x, did 0x%x\n", sub_vid, sub_did);
-            }
+    if (debug)
+        printf("probe_bus(%d)\n", busind);
 
-            baseclass = __pci_attr_r8(devind, PCI_BCR);
-            subclass = __pci_attr_r8(devind, PCI_SCR);
-            infclass = __pci_attr_r8(devind, PCI_PIFR);
+    busnr = pcibus[busind].pb_busnr;
 
-            s = pci_subclass_name((baseclass << 24) | (subclass << 16));
-            if (!s) s = pci_baseclass_name(baseclass << 24);
-            if (!s) s = "(unknown class)";
+    /* Probing absent functions sets the master-abort bits in the bus
+     * status register. Clear them once for the whole bus and look at
+     * them once when the pass is done.
+     */
+    pci_attr_wsts(busind, PSR_SSE | PSR_RMAS | PSR_RTAS);
 
-            if (debug) {
-                printf("\tclass %s (%X/%X/%X)\n", s, baseclass, subclass, infclass);
-            }
+    /* Below a PCIe root or downstream port only device 0 can exist. */
+    ndev = (pcibus[busind].pb_probe & PBP_DEV0) ? 1 : 32;
 
-            if (is_duplicate(busnr, dev, func)) {
-                printf("\tduplicate!\n");
-                if (func == 0 && !(headt & PHT_MULTIFUNC)) break;
+    for (dev = 0; dev < ndev; dev++) {
+        for (func = 0; func < 8; func++) {
+            headt = probe_func(busind, dev, func, &devind);
+            if (headt < 0) {
+                if (func == 0) break;
                 continue;
             }
 
-            devind = nr_pcidev;
-            nr_pcidev++;
-
-            pcidev[devind].pd_baseclass = baseclass;
-            pcidev[devind].pd_subclass = subclass;
-            pcidev[devind].pd_infclass = infclass;
-            pcidev[devind].pd_vid = vid;
-            pcidev[devind].pd_did = did;
-            pcidev[devind].pd_sub_vid = sub_vid;
-            pcidev[devind].pd_sub_did = sub_did;
-            pcidev[devind].pd_inuse = 0;
-            pcidev[devind].pd_bar_nr = 0;
-
-            record_irq(devind);
-
-            switch (headt & PHT_MASK) {
-                case PHT_NORMAL:
-                    record_bars_normal(devind);
-                    break;
-                case PHT_BRIDGE:
-                    record_bars_bridge(devind);
-                    break;
-                case PHT_CARDBUS:
-                    record_bars_cardbus(devind);
-                    break;
-                default:
-                    printf("\t%d.%d.%d: unknown header type %d\n", busind, dev, func, headt & PHT_MASK);
+            if (dev == 0 && func == 0 &&
+                (pcibus[busind].pb_probe & PBP_ARI)) {
+                if (devind < 0)
+                    _pci_find_dev(busnr, 0, 0, &devind);
+                if (devind >= 0 && probe_ari(busind, devind))
                     break;
             }
 
-            if (debug)
-                print_capabilities(devind);
-
-            devind = nr_pcidev;
-
             if (func == 0 && !(headt & PHT_MULTIFUNC))
                 break;
         }
     }
+
+    sts = pci_attr_rsts(busind);
+    if ((sts & (PSR_SSE | PSR_RMAS | PSR_RTAS)) && !warned) {
+        printf("PCI: ignoring bad value 0x%x in sts for QEMU\n",
+            sts & (PSR_SSE | PSR_RMAS | PSR_RTAS));
+        warned = 1;
+    }
+
+    pcii_unselect();
 }
 
 
 static u16_t pcibr_std_rsts(int busind)
 {
-    if (busind < 0 || busind >= PCIBUS_MAX_COUNT) {
+    if (busind < 0 || busind >= pcibus_alloc) {
         return 0;
     }
 
@@ -1504,7 +3379,7 @@ static u16_t pcibr_std_rsts(int busind)
 
 static void pcibr_std_wsts(int busind, u16_t value)
 {
-    if (busind < 0 || busind >= MAX_PCIBUS || pcibus[busind].pb_devind < 0) {
+    if (busind < 0 || busind >= pcibus_alloc || pcibus[busind].pb_devind < 0) {
         return;
     }
     __pci_attr_w16(pcibus[busind].pb_devind, PPB_SSTS, value);
@@ -1512,7 +3387,7 @@ static void pcibr_std_wsts(int busind, u16_t value)
 
 static u16_t pcibr_cb_rsts(int busind)
 {
-	if (busind < 0 || busind >= MAX_PCIBUS || pcibus[busind].pb_devind < 0) {
+	if (busind < 0 || busind >= pcibus_alloc || pcibus[busind].pb_devind < 0) {
 		return 0;
 	}
 	return __pci_attr_r16(pcibus[busind].pb_devind, CBB_SSTS);
@@ -1520,7 +3395,7 @@ static u16_t pcibr_cb_rsts(int busind)
 
 static void pcibr_cb_wsts(int busind, u16_t value)
 {
-    if (busind < 0 || busind >= MAX_PCIBUS || pcibus[busind].pb_devind < 0) {
+    if (busind < 0 || busind >= pcibus_alloc || pcibus[busind].pb_devind < 0) {
         return;
     }
     int devind = pcibus[busind].pb_devind;
@@ -1541,62 +3416,89 @@ static void pcibr_via_wsts(int busind, u16_t value)
     (void)value;
 }
 
-static void complete_bridges(void) {
-    for (int i = 0; i < nr_pcibus; i++) {
-        if (!pcibus[i].pb_needinit)
-            continue;
+/*===========================================================================*
+ *				Bus numbers				     *
+ *===========================================================================*/
+/* Every bus owns the numbers from its own up to pb_subord. Those not used
+ * by the buses below it are in pb_busfree, from which bridges that need
+ * numbers are served; the host bus owns 1 to 255.
+ */
+static int pci_bridge_bus(int devind)
+{
+	int i;
 
-        printf("should allocate bus number for bus %d\n", i);
-        int freebus = get_freebus();
-        if (freebus < 0) {
-            fprintf(stderr, "Error: Unable to allocate bus number\n");
-            continue;
-        }
-        printf("got bus number %d\n", freebus);
+	/* The bus behind bridge devind, or -1 if it has no entry yet */
+	for (i = 0; i < nr_pcibus; i++) {
+		if (pcibus[i].pb_devind == devind &&
+			pcibus[i].pb_type != PBT_GONE)
+			return i;
+	}
+	return -1;
+}
 
-        int devind = pcibus[i].pb_devind;
-        if (devind < 0 || devind >= MAX_PCIDEV) {
-            fprintf(stderr, "Error: Invalid device index %d\n", devind);
-            continue;
-        }
+static void bus_map_bridge(int busind)
+{
+	int devind = pcibus[busind].pb_devind;
 
-        int prim_busnr = pcidev[devind].pd_busnr;
-        if (prim_busnr != 0) {
-            printf("complete_bridge: updating subordinate bus number not implemented\n");
-        }
+	if (machine.apic_enabled) {
+		pcii_unselect();
+		acpi_map_bridge(pciid[devind].pi_busnr, pciid[devind].pi_dev,
+			pcibus[busind].pb_busnr);
+	}
+
+	if (debug) {
+		printf("bus(table) = %d, bus(sec) = %d, bus(subord) = %d\n",
+			busind, pcibus[busind].pb_busnr,
+			pcibus[busind].pb_subord);
+	}
+}
+
+/*===========================================================================*
+ *				pcie_link_probe				     *
+ *===========================================================================*/
+static void pcie_link_probe(int busind, int br_devind)
+{
+    int cap, type;
 
-        pcibus[i].pb_needinit = 0;
-        pcibus[i].pb_busnr = freebus;
+    /* Look at the PCIe capability of the bridge that leads to this bus.
+     * Root ports and switch downstream ports have a point-to-point link
+     * below them, so only device 0 needs to be probed there.
+     */
+    pcibus[busind].pb_pciecap = 0;
+    pcibus[busind].pb_probe = 0;
 
-        printf("devind = %d\n", devind);
-        printf("prim_busnr= %d\n", prim_busnr);
+    cap = pci_find_cap(br_devind, PCI_CAP_PCIE);
+    if (cap == 0)
+        return;
+    pcibus[busind].pb_pciecap = cap;
 
-        __pci_attr_w8(devind, PPB_PRIMBN, prim_busnr);
-        __pci_attr_w8(devind, PPB_SECBN, freebus);
-        __pci_attr_w8(devind, PPB_SUBORDBN, freebus);
+    type = PCIE_CAP_TYPE(__pci_attr_r16(br_devind, cap + PCIE_CAPREG));
+    if (type != PCIE_TYPE_ROOT && type != PCIE_TYPE_DOWN)
+        return;
 
-        printf("CR = 0x%x\n", __pci_attr_r16(devind, PCI_CR));
-        printf("SECBLT = 0x%x\n", __pci_attr_r8(devind, PPB_SECBLT));
-        printf("BRIDGECTRL = 0x%x\n", __pci_attr_r16(devind, PPB_BRIDGECTRL));
-    }
+    pcibus[busind].pb_probe |= PBP_DEV0;
+    if (__pci_attr_r32(br_devind, cap + PCIE_DEVCAP2) & PCIE_DEVCAP2_ARI)
+        pcibus[busind].pb_probe |= PBP_ARI;
 }
 
 static void do_pcibridge(int busind) {
-    int devind, busnr, ind, type;
+    int devind, ind, type, needinit;
     u16_t vid, did;
-    u8_t sbusn, baseclass, subclass, infclass, headt;
+    u8_t sbusn, subord, baseclass, subclass, infclass, headt;
     u32_t t3;
 
-    busnr = pcibus[busind].pb_busnr;
-    for (devind = 0; devind < nr_pcidev; devind++) {
-        if (pcidev[devind].pd_busnr != busnr) {
-            continue;
-        }
-
-        vid = pcidev[devind].pd_vid;
-        did = pcidev[devind].pd_did;
-
-        headt = __pci_attr_r8(devind, PCI_HEADT);
+    /* Add a bus table entry for every bridge on this bus. The new buses
+     * are probed later by pci_enum_buses; the identification below only
+     * uses values recorded by probe_func and shadowed registers. A bridge
+     * whose bus numbers are unset, or clash with what is already taken,
+     * gets an entry marked pb_needinit; complete_bridges numbers those.
+     */
+    for (devind = pcibus[busind].pb_first_dev; devind >= 0;
+        devind = pcidev[devind].pd_next) {
+        vid = pciid[devind].pi_vid;
+        did = pciid[devind].pi_did;
+
+        headt = pciid[devind].pi_headt;
         if ((headt & PHT_MASK) == PHT_BRIDGE) {
             type = PCI_PPB_STD;
         } else if ((headt & PHT_MASK) == PHT_CARDBUS) {
@@ -1605,9 +3507,9 @@ static void do_pcibridge(int busind) {
             continue;
         }
 
-        baseclass = __pci_attr_r8(devind, PCI_BCR);
-        subclass = __pci_attr_r8(devind, PCI_SCR);
-        infclass = __pci_attr_r8(devind, PCI_PIFR);
+        baseclass = pciid[devind].pi_baseclass;
+        subclass = pciid[devind].pi_subclass;
+        infclass = pciid[devind].pi_infclass;
         t3 = ((baseclass << 16) | (subclass << 8) | infclass);
 
         if (type == PCI_PPB_STD &&
@@ -1625,36 +3527,50 @@ static void do_pcibridge(int busind) {
 
         if (debug) {
             printf("%u.%u.%u: PCI-to-PCI bridge: %04X:%04X\n",
-                pcidev[devind].pd_busnr,
-                pcidev[devind].pd_dev,
-                pcidev[devind].pd_func, vid, did);
+                pciid[devind].pi_busnr,
+                pciid[devind].pi_dev,
+                pciid[devind].pi_func, vid, did);
         }
 
         sbusn = __pci_attr_r8(devind, PPB_SECBN);
+        subord = __pci_attr_r8(devind, PPB_SUBORDBN);
 
-        if (sbusn == 0) {
-            printf("Secondary bus number not initialized\n");
+        ind = sbusn != 0 ? get_busind(sbusn) : -1;
+        if (ind >= 0 && pcibus[ind].pb_devind == devind) {
+            /* Already known, e.g. when a bus is rescanned. */
             continue;
         }
+        if (pci_bridge_bus(devind) >= 0)
+            continue;
 
-        if (nr_pcibus >= NR_PCIBUS) {
-            panic("too many PCI busses: %d", nr_pcibus);
+        needinit = (sbusn <= pcibus[busind].pb_busnr || subord < sbusn ||
+            !ra_covers(&pcibus[busind].pb_busfree, sbusn,
+            subord - sbusn + 1));
+        if (needinit && sbusn != 0) {
+            printf("PCI: %u.%u.%u: bus numbers %u-%u are in use, renumbering\n",
+                pciid[devind].pi_busnr, pciid[devind].pi_dev,
+                pciid[devind].pi_func, sbusn, subord);
         }
 
+        pci_reserve_bus(nr_pcibus);
+
         ind = nr_pcibus++;
         pcibus[ind].pb_type = (type == PCI_PPB_CB) ? PBT_CARDBUS : PBT_PCIBRIDGE;
-        pcibus[ind].pb_needinit = 0;
+        pcibus[ind].pb_needinit = needinit;
         pcibus[ind].pb_isabridge_dev = -1;
         pcibus[ind].pb_isabridge_type = 0;
         pcibus[ind].pb_devind = devind;
-        pcibus[ind].pb_busnr = sbusn;
-
-        pcibus[ind].pb_rreg8 = pcibus[busind].pb_rreg8;
-        pcibus[ind].pb_rreg16 = pcibus[busind].pb_rreg16;
-        pcibus[ind].pb_rreg32 = pcibus[busind].pb_rreg32;
-        pcibus[ind].pb_wreg8 = pcibus[busind].pb_wreg8;
-        pcibus[ind].pb_wreg16 = pcibus[busind].pb_wreg16;
-        pcibus[ind].pb_wreg32 = pcibus[busind].pb_wreg32;
+        pcibus[ind].pb_segment = pcibus[busind].pb_segment;
+        pcibus[ind].pb_first_dev = -1;
+        pcibus[ind].pb_last_dev = -1;
+        if (!needinit) {
+            ra_reserve(&pcibus[busind].pb_busfree, sbusn, subord - sbusn + 1);
+            ra_free(&pcibus[ind].pb_busfree, sbusn + 1, subord - sbusn);
+            pcibus[ind].pb_subord = subord;
+            pci_set_busnr(ind, sbusn);
+        }
+        pcie_link_probe(ind, devind);
+        record_windows(ind);
 
         switch (type) {
             case PCI_PPB_STD:
@@ -1673,22 +3589,212 @@ static void do_pcibridge(int busind) {
                 panic("unknown PCI-PCI bridge type: %d", type);
         }
 
-        if (machine.apic_enabled) {
-            acpi_map_bridge(pcidev[devind].pd_busnr,
-                            pcidev[devind].pd_dev, sbusn);
-        }
-
-        if (debug) {
-            printf("bus(table) = %d, bus(sec) = %d, bus(subord) = %d\n",
-                   ind, sbusn, __pci_attr_r8(devind, PPB_SUBORDBN));
-        }
+        if (!needinit)
+            bus_map_bridge(ind);
+    }
+}
 
+/*===========================================================================*
+ *				pci_enum_buses				     *
+ *===========================================================================*/
+static void pci_enum_buses(int busind)
+{
+    int ind, first;
+
+    /* Breadth-first walk of the hierarchy below busind, which has already
+     * been probed. do_pcibridge appends the secondary buses it finds to
+     * pcibus[], so the table itself is the work queue: every level is
+     * probed after the one above it, without recursion. Buses that were
+     * known before are not probed again, and those still waiting for bus
+     * numbers are left to complete_bridges.
+     */
+    first = nr_pcibus;
+    do_pcibridge(busind);
+    for (ind = first; ind < nr_pcibus; ind++) {
+        if (pcibus[ind].pb_needinit)
+            continue;
         probe_bus(ind);
-
         do_pcibridge(ind);
     }
 }
 
+/*===========================================================================*
+ *				bus_spare				     *
+ *===========================================================================*/
+static int bus_spare(int busind)
+{
+	int devind, cap;
+
+	/* How many numbers to keep free behind a bridge for devices that
+	 * are plugged in later: some for CardBus bridges and hot-plug
+	 * capable PCIe slots, none otherwise.
+	 */
+	if (pcibus[busind].pb_type == PBT_CARDBUS)
+		return CBB_SPARE;
+
+	devind = pcibus[busind].pb_devind;
+	cap = pcibus[busind].pb_pciecap;
+	if (cap == 0 ||
+		!(__pci_attr_r16(devind, cap + PCIE_CAPREG) & PCIE_CAP_SLOT))
+		return 0;
+	if (!(__pci_attr_r32(devind, cap + PCIE_SLOTCAP) & PCIE_SLOTCAP_HPC))
+		return 0;
+	return PCI_HP_SPARE;
+}
+
+static void bus_program(int busind)
+{
+	int devind = pcibus[busind].pb_devind;
+
+	/* The CardBus bus number registers sit at the same offsets. */
+	__pci_attr_w8(devind, PPB_PRIMBN, pciid[devind].pi_busnr);
+	__pci_attr_w8(devind, PPB_SECBN, pcibus[busind].pb_busnr);
+	__pci_attr_w8(devind, PPB_SUBORDBN, pcibus[busind].pb_subord);
+}
+
+/*===========================================================================*
+ *				bus_grow				     *
+ *===========================================================================*/
+static int bus_grow(int busind)
+{
+	int parent, n;
+
+	/* Add the number after pb_subord to the range of busind. It is
+	 * taken from the bus above, whose range is grown first if it ends
+	 * there too. Every bridge on the way gets its new subordinate
+	 * number.
+	 */
+	if (pcibus[busind].pb_type == PBT_INTEL_HOST)
+		return ENOSPC;
+	n = pcibus[busind].pb_subord + 1;
+	if (n > 255)
+		return ENOSPC;
+
+	parent = win_parent(busind);
+	if (n > pcibus[parent].pb_subord && bus_grow(parent) != OK)
+		return ENOSPC;
+	if (!ra_covers(&pcibus[parent].pb_busfree, n, 1))
+		return ENOSPC;
+
+	ra_reserve(&pcibus[parent].pb_busfree, n, 1);
+	ra_free(&pcibus[busind].pb_busfree, n, 1);
+	pcibus[busind].pb_subord = n;
+	__pci_attr_w8(pcibus[busind].pb_devind, PPB_SUBORDBN, n);
+	return OK;
+}
+
+static void bus_scan(int busind);
+
+/*===========================================================================*
+ *				bus_assign				     *
+ *===========================================================================*/
+static void bus_assign(int busind)
+{
+	struct res_alloc *ra;
+	int parent, devind, sec, end, subord, first, last, run, i;
+
+	/* Number the bridge of busind and everything behind it, depth
+	 * first. The bridge takes the largest free run of numbers of its
+	 * parent (the lowest of equals), as it can't know yet how many the
+	 * subtree needs. The subordinate number goes at the end of the run,
+	 * so that configuration cycles reach the whole subtree while it is
+	 * scanned. Afterwards the range is cut down to what the subtree used, plus
+	 * spare numbers for a hot-plug bridge, and the rest is given back.
+	 */
+	parent = win_parent(busind);
+	devind = pcibus[busind].pb_devind;
+	ra = &pcibus[parent].pb_busfree;
+	if (ra->ra_nr == 0 && bus_grow(parent) != OK) {
+		printf("PCI: no bus number for bridge %u.%u.%u\n",
+			pciid[devind].pi_busnr, pciid[devind].pi_dev,
+			pciid[devind].pi_func);
+		return;
+	}
+	run = 0;
+	for (i = 1; i < ra->ra_nr; i++) {
+		if (ra->ra_range[i].rr_size > ra->ra_range[run].rr_size)
+			run = i;
+	}
+	sec = ra->ra_range[run].rr_base;
+	end = sec + ra->ra_range[run].rr_size - 1;
+	ra_reserve(ra, sec, end - sec + 1);
+
+	pcibus[busind].pb_needinit = 0;
+	pcibus[busind].pb_subord = end;
+	if (end > sec)
+		ra_free(&pcibus[busind].pb_busfree, sec + 1, end - sec);
+	pci_set_busnr(busind, sec);
+	bus_program(busind);
+
+	first = nr_pcibus;
+	bus_scan(busind);
+	last = nr_pcibus;
+
+	/* bus_scan may have moved pcibus[] and grown this range. */
+	ra = &pcibus[parent].pb_busfree;
+	end = pcibus[busind].pb_subord;
+	subord = sec;
+	for (i = first; i < last; i++) {
+		if (win_parent(i) == busind && !pcibus[i].pb_needinit &&
+			pcibus[i].pb_type != PBT_GONE &&
+			pcibus[i].pb_subord > subord)
+			subord = pcibus[i].pb_subord;
+	}
+	subord += bus_spare(busind);
+	if (subord > end)
+		subord = end;
+
+	if (subord < end) {
+		ra_reserve(&pcibus[busind].pb_busfree, subord + 1, end - subord);
+		ra_free(ra, subord + 1, end - subord);
+	}
+	pcibus[busind].pb_subord = subord;
+	__pci_attr_w8(devind, PPB_SUBORDBN, subord);
+	bus_map_bridge(busind);
+}
+
+/*===========================================================================*
+ *				bus_scan				     *
+ *===========================================================================*/
+static void bus_scan(int busind)
+{
+	int i, first, last;
+
+	/* Probe busind and, depth first, the buses behind it. Unlike
+	 * pci_enum_buses, bridges that need numbers are numbered on the
+	 * way down, before their siblings further on.
+	 */
+	probe_bus(busind);
+	first = nr_pcibus;
+	do_pcibridge(busind);
+	last = nr_pcibus;
+	for (i = first; i < last; i++) {
+		if (pcibus[i].pb_needinit)
+			bus_assign(i);
+		else
+			bus_scan(i);
+	}
+}
+
+/*===========================================================================*
+ *				complete_bridges			     *
+ *===========================================================================*/
+static void complete_bridges(void)
+{
+	int i, last;
+
+	/* Number the bridges that pci_enum_buses left without bus numbers,
+	 * together with what is behind them. Buses still marked after this
+	 * had no numbers left; a later rescan tries again. Buses found on
+	 * the way were already tried by bus_assign, so don't go past last.
+	 */
+	last = nr_pcibus;
+	for (i = 0; i < last; i++) {
+		if (pcibus[i].pb_needinit && pcibus[i].pb_type != PBT_GONE)
+			bus_assign(i);
+	}
+}
+
 /*===========================================================================*
  *				pci_intel_init				     *
  *===========================================================================*/
@@ -1696,17 +3802,26 @@ static void pci_intel_init(void)
 {
 	u32_t bus = 0, dev = 0, func = 0;
 	u16_t vid, did;
-	int s, i, busind, busnr, r;
+	int s, i, busind, r;
 	const char *dstr;
 
-	vid = PCII_RREG16_(bus, dev, func, PCI_VID);
-	did = PCII_RREG16_(bus, dev, func, PCI_DID);
+	ecam_init();
+
+#ifdef PCI_SIM
+	if (pcisim_active()) {
+		vid = pcisim_read(bus, dev, func, PCI_VID, 2);
+		did = pcisim_read(bus, dev, func, PCI_DID, 2);
+	} else
+#endif
+	{
+		vid = PCII_RREG16_(bus, dev, func, PCI_VID);
+		did = PCII_RREG16_(bus, dev, func, PCI_DID);
 
-	if ((s = sys_outl(PCII_CONFADD, PCII_UNSEL)) != OK)
-		printf("PCI: warning, sys_outl failed: %d\n", s);
+		if ((s = sys_outl(PCII_CONFADD, PCII_UNSEL)) != OK)
+			printf("PCI: warning, sys_outl failed: %d\n", s);
+	}
 
-	if (nr_pcibus >= NR_PCIBUS)
-		panic("too many PCI busses: %d", nr_pcibus);
+	pci_reserve_bus(nr_pcibus);
 
 	busind = nr_pcibus++;
 	pcibus[busind].pb_type = PBT_INTEL_HOST;
@@ -1714,15 +3829,14 @@ static void pci_intel_init(void)
 	pcibus[busind].pb_isabridge_dev = -1;
 	pcibus[busind].pb_isabridge_type = 0;
 	pcibus[busind].pb_devind = -1;
-	pcibus[busind].pb_busnr = 0;
-	pcibus[busind].pb_rreg8 = pcii_rreg8;
-	pcibus[busind].pb_rreg16 = pcii_rreg16;
-	pcibus[busind].pb_rreg32 = pcii_rreg32;
-	pcibus[busind].pb_wreg8 = pcii_wreg8;
-	pcibus[busind].pb_wreg16 = pcii_wreg16;
-	pcibus[busind].pb_wreg32 = pcii_wreg32;
-	pcibus[busind].pb_rsts = pcii_rsts;
-	pcibus[busind].pb_wsts = pcii_wsts;
+	pcibus[busind].pb_segment = 0;
+	pcibus[busind].pb_pciecap = 0;
+	pcibus[busind].pb_probe = 0;
+	pcibus[busind].pb_first_dev = -1;
+	pcibus[busind].pb_last_dev = -1;
+	pcibus[busind].pb_subord = 255;
+	ra_free(&pcibus[busind].pb_busfree, 1, 255);
+	pci_set_busnr(busind, 0);
 
 	dstr = _pci_dev_name(vid, did);
 	if (!dstr)
@@ -1735,17 +3849,26 @@ static void pci_intel_init(void)
 
 	r = do_isabridge(busind);
 	if (r != OK) {
-		busnr = pcibus[busind].pb_busnr;
-		for (i = 0; i < nr_pcidev; ++i) {
-			if (pcidev[i].pd_busnr == busnr)
-				pcidev[i].pd_inuse = 1;
+		for (i = pcibus[busind].pb_first_dev; i >= 0;
+			i = pcidev[i].pd_next) {
+			pcidev[i].pd_inuse = 1;
 		}
+		pcii_unselect();
 		return;
 	}
 
-	do_pcibridge(busind);
+	pci_enum_buses(busind);
 	complete_bridges();
 	complete_bars();
+	pcii_unselect();
+
+	if (debug) {
+		pcii_print_latch_stats();
+		pci_print_mem_usage();
+#if PCI_STATS
+		_pci_dump_stats();
+#endif
+	}
 }
 
 #if 0
@@ -1775,48 +3898,444 @@ report_vga(int devind)
 	if (size != 0)
 	{
 		printf("PCI: video memory for device at %d.%d.%d: %d bytes\n",
-			pcidev[devind].pd_busnr,
-			pcidev[devind].pd_dev,
-			pcidev[devind].pd_func,
+			pciid[devind].pi_busnr,
+			pciid[devind].pi_dev,
+			pciid[devind].pi_func,
 			amount);
 	}
 }
 #endif
 
 
+/*===========================================================================*
+ *			Compiled ACL matching				     *
+ *===========================================================================*/
+/* For every pci_acl[] slot, map_service compiles the ACL into a hash of
+ * the vid/did entries and a table of the distinct class/mask pairs. From
+ * that a bitmap of the visible devinds is built once per pci_generation,
+ * so visible() is a bit test for drivers that come through pci_acl[].
+ * Other ACLs, and slots that could not be compiled, use acl_scan.
+ */
+struct acl_class
+{
+	u32_t cl_class;
+	u32_t cl_mask;
+};
+
+static struct acl_cache
+{
+	int ac_compiled;
+	int ac_hbits;		/* log2 of the hash size */
+	short *ac_hash;		/* rsp_device index + 1 per bucket, 0 if empty */
+	short *ac_next;		/* next rsp_device entry in the same bucket */
+	struct acl_class *ac_class;
+	int ac_nr_class;
+	unsigned int ac_gen;	/* pci_generation ac_map was built for */
+	u32_t *ac_map;		/* one bit per devind */
+	int ac_map_words;
+} acl_cache[NR_DRIVERS];
+
+static unsigned int acl_hash(u16_t vid, u16_t did, int bits)
+{
+	return ((((u32_t)vid << 16) | did) * 2654435761U) >> (32 - bits);
+}
+
+static u32_t acl_devclass(int devind)
+{
+	return ((u32_t)pciid[devind].pi_baseclass << 16) |
+		((u32_t)pciid[devind].pi_subclass << 8) |
+		(u32_t)pciid[devind].pi_infclass;
+}
+
+/*===========================================================================*
+ *				acl_scan				     *
+ *===========================================================================*/
+static int acl_scan(struct rs_pci *aclp, int devind)
+{
+    for (int i = 0; i < aclp->rsp_nr_device; i++) {
+        struct rs_pci_device *dev = &aclp->rsp_device[i];
+        if (dev->vid == pciid[devind].pi_vid &&
+            dev->did == pciid[devind].pi_did &&
+            (dev->sub_vid == NO_SUB_VID || dev->sub_vid == pciid[devind].pi_sub_vid) &&
+            (dev->sub_did == NO_SUB_DID || dev->sub_did == pciid[devind].pi_sub_did)) {
+            return TRUE;
+        }
+    }
+
+    if (aclp->rsp_nr_class == 0)
+        return FALSE;
+
+    u32_t class_id = acl_devclass(devind);
+
+    for (int i = 0; i < aclp->rsp_nr_class; i++) {
+        if (aclp->rsp_class[i].pciclass ==
+            (class_id & aclp->rsp_class[i].mask)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/*===========================================================================*
+ *				acl_free				     *
+ *===========================================================================*/
+static void acl_free(int slot)
+{
+	struct acl_cache *ac = &acl_cache[slot];
+
+	free(ac->ac_hash);
+	free(ac->ac_next);
+	free(ac->ac_class);
+	free(ac->ac_map);
+	memset(ac, 0, sizeof(*ac));
+}
+
+/*===========================================================================*
+ *				acl_compile				     *
+ *===========================================================================*/
+static int acl_compile(int slot)
+{
+	struct acl_cache *ac = &acl_cache[slot];
+	struct rs_pci *aclp = &pci_acl[slot].acl;
+	struct rs_pci_device *dev;
+	u32_t mask, class;
+	unsigned int h;
+	int i, j, n;
+
+	acl_free(slot);
+
+	n = aclp->rsp_nr_device;
+	for (ac->ac_hbits = 4; (1 << ac->ac_hbits) < 2 * n; ac->ac_hbits++)
+		;
+	ac->ac_hash = calloc(1 << ac->ac_hbits, sizeof(*ac->ac_hash));
+	ac->ac_next = calloc(n ? n : 1, sizeof(*ac->ac_next));
+	ac->ac_class = calloc(aclp->rsp_nr_class ? aclp->rsp_nr_class : 1,
+		sizeof(*ac->ac_class));
+	if (ac->ac_hash == NULL || ac->ac_next == NULL ||
+		ac->ac_class == NULL) {
+		acl_free(slot);
+		return ENOMEM;
+	}
+
+	for (i = 0; i < n; i++) {
+		dev = &aclp->rsp_device[i];
+		h = acl_hash(dev->vid, dev->did, ac->ac_hbits);
+		ac->ac_next[i] = ac->ac_hash[h];
+		ac->ac_hash[h] = i + 1;
+	}
+
+	for (i = 0; i < aclp->rsp_nr_class; i++) {
+		mask = aclp->rsp_class[i].mask;
+		class = aclp->rsp_class[i].pciclass;
+		for (j = 0; j < ac->ac_nr_class; j++) {
+			if (ac->ac_class[j].cl_class == class &&
+				ac->ac_class[j].cl_mask == mask)
+				break;
+		}
+		if (j == ac->ac_nr_class) {
+			ac->ac_class[j].cl_class = class;
+			ac->ac_class[j].cl_mask = mask;
+			ac->ac_nr_class++;
+		}
+	}
+
+	ac->ac_compiled = 1;
+	return OK;
+}
+
+/*===========================================================================*
+ *				acl_match				     *
+ *===========================================================================*/
+static int acl_match(int slot, int devind)
+{
+	struct acl_cache *ac = &acl_cache[slot];
+	struct rs_pci_device *dev;
+	struct pciid *pi = &pciid[devind];
+	u32_t class;
+	int i;
+
+	if (pi->pi_flags & PIF_GONE)
+		return FALSE;
+
+	i = ac->ac_hash[acl_hash(pi->pi_vid, pi->pi_did, ac->ac_hbits)];
+	for (; i != 0; i = ac->ac_next[i - 1]) {
+		dev = &pci_acl[slot].acl.rsp_device[i - 1];
+		if (dev->vid == pi->pi_vid && dev->did == pi->pi_did &&
+			(dev->sub_vid == NO_SUB_VID ||
+			dev->sub_vid == pi->pi_sub_vid) &&
+			(dev->sub_did == NO_SUB_DID ||
+			dev->sub_did == pi->pi_sub_did))
+			return TRUE;
+	}
+
+	class = acl_devclass(devind);
+	for (i = 0; i < ac->ac_nr_class; i++) {
+		if (ac->ac_class[i].cl_class == (class & ac->ac_class[i].cl_mask))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*===========================================================================*
+ *				acl_update				     *
+ *===========================================================================*/
+static int acl_update(int slot)
+{
+	struct acl_cache *ac = &acl_cache[slot];
+	u32_t *map;
+	int devind, words;
+
+	if (ac->ac_gen == pci_generation)
+		return OK;
+
+	words = (nr_pcidev + 31) / 32;
+	if (words == 0)
+		words = 1;
+	if (words > ac->ac_map_words) {
+		map = realloc(ac->ac_map, words * sizeof(*map));
+		if (map == NULL)
+			return ENOMEM;
+		ac->ac_map = map;
+		ac->ac_map_words = words;
+	}
+
+	memset(ac->ac_map, 0, ac->ac_map_words * sizeof(*ac->ac_map));
+	for (devind = 0; devind < nr_pcidev; devind++) {
+		if (acl_match(slot, devind))
+			ac->ac_map[devind >> 5] |= 1U << (devind & 31);
+	}
+	ac->ac_gen = pci_generation;
+	return OK;
+}
+
+/*===========================================================================*
+ *				acl_refresh				     *
+ *===========================================================================*/
+static void acl_refresh(void)
+{
+	int i;
+
+	/* Rebuild the bitmaps of all compiled slots after the device table
+	 * changed, so the next lookups don't pay for it.
+	 */
+	for (i = 0; i < NR_DRIVERS; i++) {
+		if (pci_acl[i].inuse && acl_cache[i].ac_compiled)
+			acl_update(i);
+	}
+}
+
+static int acl_slot(const struct rs_pci *aclp)
+{
+	uintptr_t first = (uintptr_t)&pci_acl[0].acl;
+	size_t i;
+
+	if ((uintptr_t)aclp < first)
+		return -1;
+	i = ((uintptr_t)aclp - first) / sizeof(pci_acl[0]);
+	if (i >= NR_DRIVERS || &pci_acl[i].acl != aclp)
+		return -1;
+	return i;
+}
+
 /*===========================================================================*
  *				visible					     *
  *===========================================================================*/
 static int visible(struct rs_pci *aclp, int devind)
 {
-    if (aclp == NULL)
-        return TRUE;
+    int slot;
+
+    if (pciid[devind].pi_flags & PIF_GONE)
+        return FALSE;
+    if (aclp == NULL)
+        return TRUE;
+
+    slot = acl_slot(aclp);
+    if (slot >= 0 && pci_acl[slot].inuse && acl_cache[slot].ac_compiled &&
+        acl_update(slot) == OK) {
+        return (acl_cache[slot].ac_map[devind >> 5] >> (devind & 31)) & 1;
+    }
+
+    return acl_scan(aclp, devind);
+}
+
+/*===========================================================================*
+ *				acl_next				     *
+ *===========================================================================*/
+static int acl_next(struct rs_pci *aclp, int devind)
+{
+	u32_t *map, w;
+	int slot;
+
+	/* Return the first devind >= devind visible to aclp, or -1. With a
+	 * compiled ACL whole words of the bitmap are skipped at a time.
+	 */
+	slot = acl_slot(aclp);
+	if (slot >= 0 && pci_acl[slot].inuse && acl_cache[slot].ac_compiled &&
+		acl_update(slot) == OK) {
+		map = acl_cache[slot].ac_map;
+		while (devind < nr_pcidev) {
+			w = map[devind >> 5] >> (devind & 31);
+			if (w != 0) {
+				devind += ffs(w) - 1;
+				return devind < nr_pcidev ? devind : -1;
+			}
+			devind = (devind | 31) + 1;
+		}
+		return -1;
+	}
+
+	for (; devind < nr_pcidev; devind++) {
+		if (visible(aclp, devind))
+			return devind;
+	}
+	return -1;
+}
+
+/*===========================================================================*
+ *			Query indexes					     *
+ *===========================================================================*/
+/* Secondary indexes for _pci_query_dev, rebuilt when pci_generation
+ * changes: devinds sorted by vid/did and by class, and the class of every
+ * device in one compact array for the scans that the sorted class index
+ * can't answer.
+ */
+static struct
+{
+	unsigned int qi_gen;
+	int qi_alloc;
+	u32_t *qi_class;	/* class of devind i */
+	u8_t *qi_hit;		/* scratch for the class scan */
+	int *qi_by_vid;
+	int *qi_by_class;
+} pci_qindex;
+
+static u32_t qi_vidkey(int devind)
+{
+	return ((u32_t)pciid[devind].pi_vid << 16) | pciid[devind].pi_did;
+}
+
+static int qi_cmp_vid(const void *a, const void *b)
+{
+	u32_t ka = qi_vidkey(*(const int *)a), kb = qi_vidkey(*(const int *)b);
+
+	if (ka != kb)
+		return ka < kb ? -1 : 1;
+	return *(const int *)a - *(const int *)b;
+}
+
+static int qi_cmp_class(const void *a, const void *b)
+{
+	u32_t ka = pci_qindex.qi_class[*(const int *)a];
+	u32_t kb = pci_qindex.qi_class[*(const int *)b];
+
+	if (ka != kb)
+		return ka < kb ? -1 : 1;
+	return *(const int *)a - *(const int *)b;
+}
+
+/*===========================================================================*
+ *				pci_qindex_update			     *
+ *===========================================================================*/
+static int pci_qindex_update(void)
+{
+	void *p;
+	int i;
+
+	if (pci_qindex.qi_gen == pci_generation)
+		return OK;
+
+	if (nr_pcidev > pci_qindex.qi_alloc) {
+		if ((p = realloc(pci_qindex.qi_class,
+			pcidev_alloc * sizeof(u32_t))) == NULL)
+			return ENOMEM;
+		pci_qindex.qi_class = p;
+		if ((p = realloc(pci_qindex.qi_hit, pcidev_alloc)) == NULL)
+			return ENOMEM;
+		pci_qindex.qi_hit = p;
+		if ((p = realloc(pci_qindex.qi_by_vid,
+			pcidev_alloc * sizeof(int))) == NULL)
+			return ENOMEM;
+		pci_qindex.qi_by_vid = p;
+		if ((p = realloc(pci_qindex.qi_by_class,
+			pcidev_alloc * sizeof(int))) == NULL)
+			return ENOMEM;
+		pci_qindex.qi_by_class = p;
+		pci_qindex.qi_alloc = pcidev_alloc;
+	}
+
+	for (i = 0; i < nr_pcidev; i++) {
+		pci_qindex.qi_class[i] = acl_devclass(i);
+		pci_qindex.qi_by_vid[i] = i;
+		pci_qindex.qi_by_class[i] = i;
+	}
+	qsort(pci_qindex.qi_by_vid, nr_pcidev, sizeof(int), qi_cmp_vid);
+	qsort(pci_qindex.qi_by_class, nr_pcidev, sizeof(int), qi_cmp_class);
+
+	pci_qindex.qi_gen = pci_generation;
+	return OK;
+}
+
+/* First position in qi_by_vid whose vid/did key is >= key. */
+static int qi_vid_bound(u32_t key)
+{
+	int lo = 0, hi = nr_pcidev, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (qi_vidkey(pci_qindex.qi_by_vid[mid]) < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
 
-    for (int i = 0; i < aclp->rsp_nr_device; i++) {
-        struct rs_pci_device *dev = &aclp->rsp_device[i];
-        if (dev->vid == pcidev[devind].pd_vid &&
-            dev->did == pcidev[devind].pd_did &&
-            (dev->sub_vid == NO_SUB_VID || dev->sub_vid == pcidev[devind].pd_sub_vid) &&
-            (dev->sub_did == NO_SUB_DID || dev->sub_did == pcidev[devind].pd_sub_did)) {
-            return TRUE;
-        }
-    }
+/* First position in qi_by_class whose class is >= class. */
+static int qi_class_bound(u32_t class)
+{
+	int lo = 0, hi = nr_pcidev, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (pci_qindex.qi_class[pci_qindex.qi_by_class[mid]] < class)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
 
-    if (aclp->rsp_nr_class == 0)
-        return FALSE;
+static int qi_match(const struct pci_query *qp, int devind)
+{
+	const struct pciid *pi = &pciid[devind];
+	u32_t mask = qp->pq_class_mask & 0xffffff;
 
-    u32_t class_id = ((u32_t)pcidev[devind].pd_baseclass << 16) |
-                     ((u32_t)pcidev[devind].pd_subclass << 8) |
-                     (u32_t)pcidev[devind].pd_infclass;
+	/* Class bits above the 24 a device has are ignored, as by the
+	 * class index in _pci_query_dev.
+	 */
+	return (qp->pq_vid == PCI_QUERY_ANY || qp->pq_vid == pi->pi_vid) &&
+		(qp->pq_did == PCI_QUERY_ANY || qp->pq_did == pi->pi_did) &&
+		(qp->pq_sub_vid == PCI_QUERY_ANY ||
+		qp->pq_sub_vid == pi->pi_sub_vid) &&
+		(qp->pq_sub_did == PCI_QUERY_ANY ||
+		qp->pq_sub_did == pi->pi_sub_did) &&
+		(pci_qindex.qi_class[devind] & mask) == (qp->pq_class & mask);
+}
 
-    for (int i = 0; i < aclp->rsp_nr_class; i++) {
-        if (aclp->rsp_class[i].pciclass ==
-            (class_id & aclp->rsp_class[i].mask)) {
-            return TRUE;
-        }
-    }
+static void qi_add(struct rs_pci *aclp, const struct pci_query *qp,
+	int devind, struct pci_dev_ent *ents, int max, int *countp)
+{
+	if (!qi_match(qp, devind) || !visible(aclp, devind))
+		return;
 
-    return FALSE;
+	if (*countp < max) {
+		ents[*countp].pde_devind = pci_devind(devind);
+		ents[*countp].pde_vid = pciid[devind].pi_vid;
+		ents[*countp].pde_did = pciid[devind].pi_did;
+		ents[*countp].pde_class = pci_qindex.qi_class[devind];
+	}
+	(*countp)++;
 }
 
 /*===========================================================================*
@@ -1832,6 +4351,10 @@ int sef_cb_init(int type, sef_init_info_t *info)
 	env_parse("pci_debug", "d", 0, &v, 0, 1);
 	debug = v;
 
+	v = 1;
+	env_parse("pci_ecam", "d", 0, &v, 0, 1);
+	use_ecam = v;
+
 	if (sys_getmachine(&machine)) {
 		printf("PCI: no machine\n");
 		return ENODEV;
@@ -1881,6 +4404,228 @@ int sef_cb_init(int type, sef_init_info_t *info)
 	return OK;
 }
 
+#ifdef PCI_SIM
+/*===========================================================================*
+ *				_pci_sim_init				     *
+ *===========================================================================*/
+int _pci_sim_init(const char *topology)
+{
+	/* Enumerate a simulated topology instead of the hardware. Used when
+	 * the enumerator runs as an ordinary host process.
+	 */
+	if (pcisim_load(topology) != 0)
+		return EINVAL;
+
+	pci_intel_init();
+	return OK;
+}
+
+/*===========================================================================*
+ *				_pci_sim_slots				     *
+ *===========================================================================*/
+int _pci_sim_slots(void)
+{
+	/* Size of the device table, freed slots included, so that the host
+	 * tests can check that hot-plug cycles reuse them.
+	 */
+	return nr_pcidev;
+}
+#endif
+
+#ifdef PCI_BENCH
+/*===========================================================================*
+ *				Benchmarks				     *
+ *===========================================================================*/
+#define BENCH_ROUNDS	100	/* passes over the device table per API test */
+#define BENCH_MAX_FN	8192	/* function limit passed to pcisim_gen */
+
+static const struct
+{
+	int kind;
+	const char *name;
+} bench_topo[]=
+{
+	{ PCISIM_GEN_FLAT,	"flat" },
+	{ PCISIM_GEN_CHAIN,	"chain" },
+	{ PCISIM_GEN_FULL,	"full" },
+	{ PCISIM_GEN_MULTIFN,	"multifn" },
+};
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_reset(void)
+{
+	int i, w;
+
+	for (i = 0; i < nr_pcibus; i++) {
+		for (w = 0; w < PBW_NR; w++)
+			free(pcibus[i].pb_win[w].pw_free.ra_range);
+		free(pcibus[i].pb_busfree.ra_range);
+	}
+	for (i = 0; i < 256; i++) {
+		free(pci_bdf_index[i]);
+		pci_bdf_index[i] = NULL;
+	}
+	free(ra_mem.ra_range);
+	free(ra_io.ra_range);
+	free(ra_mem_seed.ra_range);
+	free(ra_io_seed.ra_range);
+	memset(&ra_mem, 0, sizeof(ra_mem));
+	memset(&ra_io, 0, sizeof(ra_io));
+	memset(&ra_mem_seed, 0, sizeof(ra_mem_seed));
+	memset(&ra_io_seed, 0, sizeof(ra_io_seed));
+	ra_seeded = 0;
+	free(pciid);
+	free(pcidev);
+	free(pcibus);
+	pciid = NULL;
+	pcidev = NULL;
+	pcibus = NULL;
+	pcidev_alloc = pcibus_alloc = 0;
+	memset(pci_busmap, 0, sizeof(pci_busmap));
+	nr_pcidev = 0;
+	nr_pcibus = 0;
+	pci_free_dev = -1;
+}
+
+/*===========================================================================*
+ *				_pci_bench				     *
+ *===========================================================================*/
+int _pci_bench(FILE *out)
+{
+	struct pcisim_stats st;
+	struct rs_pci acl, acl_miss;
+	static const struct pci_query bench_query[] = {
+		/* vendor and device, base class, subclass of any base class */
+		{ 0x8086, 0x1001, PCI_QUERY_ANY, PCI_QUERY_ANY, 0, 0 },
+		{ PCI_QUERY_ANY, PCI_QUERY_ANY, PCI_QUERY_ANY, PCI_QUERY_ANY,
+			0x020000, 0xff0000 },
+		{ PCI_QUERY_ANY, PCI_QUERY_ANY, PCI_QUERY_ANY, PCI_QUERY_ANY,
+			0x000400, 0x00ff00 },
+	};
+	double t0, t_init, t_attr, t_iter, t_find, t_scan, t_query;
+	int q, count;
+	unsigned long n_attr, n_iter, n_find, n_scan;
+	int i, r, devind, found, nfn;
+	u16_t vid, did;
+	u32_t v32;
+
+	/* Enumerate each synthetic topology and exercise the driver-facing
+	 * query API against it. One CSV line per topology, so results of
+	 * different builds can be compared with diff or a spreadsheet.
+	 */
+	memset(&acl, 0, sizeof(acl));
+	acl.rsp_nr_class = 1;		/* class 0, mask 0: everything */
+
+	/* An ACL that matches nothing: _pci_first_dev has to look at the
+	 * identity and class of every device, which is the table scan cost.
+	 */
+	memset(&acl_miss, 0, sizeof(acl_miss));
+	acl_miss.rsp_nr_device = 1;
+	acl_miss.rsp_device[0].vid = NO_VID;
+	acl_miss.rsp_device[0].did = NO_VID;
+	acl_miss.rsp_device[0].sub_vid = NO_SUB_VID;
+	acl_miss.rsp_device[0].sub_did = NO_SUB_DID;
+	acl_miss.rsp_nr_class = 1;
+	acl_miss.rsp_class[0].pciclass = 0xffffff;
+	acl_miss.rsp_class[0].mask = 0xffffff;
+
+	fprintf(out, "topology,functions,devices,buses,init_us,"
+		"cfg_reads,cfg_writes,cfg_per_fn,attr_r32_per_s,"
+		"iter_per_s,find_per_s,scan_ns_per_dev,query_us,table_bytes\n");
+
+	for (i = 0; i < (int)(sizeof(bench_topo) / sizeof(bench_topo[0]));
+	    i++) {
+		bench_reset();
+		nfn = pcisim_gen(bench_topo[i].kind, BENCH_MAX_FN, 256);
+		if (nfn < 0)
+			return EINVAL;
+
+		pcisim_clear_stats();
+		t0 = bench_now();
+		pci_intel_init();
+		t_init = bench_now() - t0;
+		pcisim_get_stats(&st);
+
+		n_attr = 0;
+		t0 = bench_now();
+		for (r = 0; r < BENCH_ROUNDS; r++) {
+			for (devind = 0; devind < nr_pcidev; devind++) {
+				_pci_attr_r32(devind, PCI_VID, &v32);
+				_pci_attr_r32(devind, PCI_SR & ~3, &v32);
+				n_attr += 2;
+			}
+		}
+		t_attr = bench_now() - t0;
+
+		n_iter = 0;
+		t0 = bench_now();
+		for (r = 0; r < BENCH_ROUNDS; r++) {
+			if (!_pci_first_dev(&acl, &devind, &vid, &did))
+				break;
+			do {
+				n_iter++;
+			} while (_pci_next_dev(&acl, &devind, &vid, &did));
+		}
+		t_iter = bench_now() - t0;
+
+		/* Count the hits, so the lookups can't be optimized away */
+		n_find = 0;
+		t0 = bench_now();
+		for (r = 0; r < BENCH_ROUNDS; r++) {
+			for (devind = 0; devind < nr_pcidev; devind++) {
+				n_find += _pci_find_dev(pciid[devind].pi_busnr,
+					pciid[devind].pi_dev,
+					pciid[devind].pi_func, &found);
+			}
+		}
+		t_find = bench_now() - t0;
+
+		/* acl_miss must not match; n_scan also keeps the calls alive */
+		n_scan = 0;
+		t0 = bench_now();
+		for (r = 0; r < BENCH_ROUNDS; r++)
+			n_scan += _pci_first_dev(&acl_miss, &devind, &vid, &did);
+		t_scan = bench_now() - t0;
+
+		_pci_query_dev(NULL, &bench_query[0], NULL, 0, &count);
+		t0 = bench_now();
+		for (r = 0; r < BENCH_ROUNDS; r++) {
+			for (q = 0; q < (int)(sizeof(bench_query) /
+				sizeof(bench_query[0])); q++) {
+				_pci_query_dev(NULL, &bench_query[q], NULL, 0,
+					&count);
+			}
+		}
+		t_query = (bench_now() - t0) / (BENCH_ROUNDS *
+			(sizeof(bench_query) / sizeof(bench_query[0])));
+
+		fprintf(out, "%s,%d,%d,%d,%.0f,%lu,%lu,%.1f,%.0f,%.0f,%.0f,%.2f,"
+			"%.2f,%u\n",
+			bench_topo[i].name, nfn, nr_pcidev, nr_pcibus,
+			t_init * 1e6, st.ps_reads, st.ps_writes,
+			nr_pcidev ? (double)(st.ps_reads + st.ps_writes) /
+			nr_pcidev : 0.0,
+			t_attr > 0 ? n_attr / t_attr : 0.0,
+			t_iter > 0 ? n_iter / t_iter : 0.0,
+			t_find > 0 ? n_find / t_find : 0.0,
+			nr_pcidev && n_scan == 0 ? t_scan * 1e9 /
+			((double)BENCH_ROUNDS * nr_pcidev) : 0.0,
+			t_query * 1e6,
+			(unsigned)pci_mem_usage());
+	}
+
+	pcisim_reset();
+	return OK;
+}
+#endif /* PCI_BENCH */
+
 /*===========================================================================*
  *		               map_service                                   *
  *===========================================================================*/
@@ -1903,6 +4648,9 @@ int map_service(struct rprocpub *rpub)
     pci_acl[i].inuse = 1;
     pci_acl[i].acl = rpub->pci_acl;
 
+    if (acl_compile(i) != OK || acl_update(i) != OK)
+        printf("PCI: map_service: no memory to compile ACL, using scan\n");
+
     return OK;
 }
 
@@ -1911,19 +4659,17 @@ int map_service(struct rprocpub *rpub)
  *===========================================================================*/
 int _pci_find_dev(u8_t bus, u8_t dev, u8_t func, int *devindp)
 {
-    if (devindp == NULL) {
+    int devind;
+
+    if (devindp == NULL || dev > 31 || func > 7) {
         return 0;
     }
 
-    for (int devind = 0; devind < nr_pcidev; devind++) {
-        if (pcidev[devind].pd_busnr == bus &&
-            pcidev[devind].pd_dev == dev &&
-            pcidev[devind].pd_func == func) {
-            *devindp = devind;
-            return 1;
-        }
-    }
-    return 0;
+    devind = pci_index_lookup(bus, dev, func);
+    if (devind < 0 || (pciid[devind].pi_flags & PIF_GONE))
+        return 0;
+    *devindp = pci_devind(devind);
+    return 1;
 }
 
 /*===========================================================================*
@@ -1931,18 +4677,19 @@ int _pci_find_dev(u8_t bus, u8_t dev, u8_t func, int *devindp)
  *===========================================================================*/
 int _pci_first_dev(struct rs_pci *aclp, int *devindp, u16_t *vidp, u16_t *didp)
 {
+    int devind;
+
     if (!aclp || !devindp || !vidp || !didp)
         return 0;
 
-    for (int devind = 0; devind < nr_pcidev; devind++) {
-        if (visible(aclp, devind)) {
-            *devindp = devind;
-            *vidp = pcidev[devind].pd_vid;
-            *didp = pcidev[devind].pd_did;
-            return 1;
-        }
-    }
-    return 0;
+    devind = acl_next(aclp, 0);
+    if (devind < 0)
+        return 0;
+
+    *devindp = pci_devind(devind);
+    *vidp = pciid[devind].pi_vid;
+    *didp = pciid[devind].pi_did;
+    return 1;
 }
 
 /*===========================================================================*
@@ -1953,30 +4700,147 @@ int _pci_next_dev(struct rs_pci *aclp, int *devindp, u16_t *vidp, u16_t *didp) {
         return 0;
     }
 
-    int devind = *devindp + 1;
-    while (devind < nr_pcidev) {
-        if (visible(aclp, devind)) {
-            *devindp = devind;
-            *vidp = pcidev[devind].pd_vid;
-            *didp = pcidev[devind].pd_did;
-            return 1;
-        }
-        devind++;
-    }
-    return 0;
+    int devind = acl_next(aclp, *devindp < 0 ? 0 : PCI_SLOT(*devindp) + 1);
+    if (devind < 0)
+        return 0;
+
+    *devindp = pci_devind(devind);
+    *vidp = pciid[devind].pi_vid;
+    *didp = pciid[devind].pi_did;
+    return 1;
+}
+
+/*===========================================================================*
+ *				_pci_iter_dev				     *
+ *===========================================================================*/
+int _pci_iter_dev(struct rs_pci *aclp, pci_cursor_t *cursorp,
+	struct pci_dev_ent *ents, int max, int *countp)
+{
+	u32_t gen;
+	int devind, n;
+
+	/* Return up to max visible devices, continuing where the previous
+	 * call with the same cursor left off. The cursor holds the device
+	 * table generation and the next devind. If the table changed since
+	 * the cursor was handed out, nothing is returned and ESTALE tells
+	 * the driver to start over; the cursor is reset for that.
+	 * A reply with *countp == 0 marks the end, so max must be at least
+	 * one; otherwise every call would look like the end.
+	 */
+	if (!aclp || !cursorp || !ents || !countp || max <= 0)
+		return EINVAL;
+
+	*countp = 0;
+	gen = *cursorp >> 32;
+	devind = *cursorp & 0xffffffff;
+
+	if (*cursorp == PCI_CURSOR_INIT) {
+		gen = pci_generation;
+		devind = 0;
+	} else if (gen != pci_generation) {
+		*cursorp = PCI_CURSOR_INIT;
+		return ESTALE;
+	}
+
+	for (n = 0; n < max; n++) {
+		devind = acl_next(aclp, devind);
+		if (devind < 0) {
+			devind = nr_pcidev;
+			break;
+		}
+		ents[n].pde_devind = pci_devind(devind);
+		ents[n].pde_vid = pciid[devind].pi_vid;
+		ents[n].pde_did = pciid[devind].pi_did;
+		ents[n].pde_class = acl_devclass(devind);
+		devind++;
+	}
+
+	*countp = n;
+	*cursorp = ((pci_cursor_t)gen << 32) | (u32_t)devind;
+	return OK;
+}
+
+/*===========================================================================*
+ *				_pci_query_dev				     *
+ *===========================================================================*/
+int _pci_query_dev(struct rs_pci *aclp, const struct pci_query *qp,
+	struct pci_dev_ent *ents, int max, int *countp)
+{
+	u32_t mask, want, rest, key;
+	u32_t *cls;
+	u8_t *hit;
+	int i, lo, hi, n;
+
+	/* Find every device visible to aclp (all devices if aclp is NULL)
+	 * that matches qp. *countp is set to the number of matches; the
+	 * first max of them are stored in ents.
+	 */
+	if (!qp || !countp || max < 0 || (max > 0 && !ents))
+		return EINVAL;
+
+	*countp = 0;
+	if (pci_qindex_update() != OK)
+		return ENOMEM;
+
+	mask = qp->pq_class_mask & 0xffffff;
+	want = qp->pq_class & mask;
+	rest = ~mask & 0xffffff;
+
+	if (qp->pq_vid != PCI_QUERY_ANY) {
+		/* The vendor (and device) is a range of the vid index. */
+		key = (u32_t)qp->pq_vid << 16;
+		if (qp->pq_did != PCI_QUERY_ANY) {
+			lo = qi_vid_bound(key | qp->pq_did);
+			hi = qi_vid_bound((key | qp->pq_did) + 1);
+		} else {
+			lo = qi_vid_bound(key);
+			hi = qi_vid_bound(key + 0x10000);
+		}
+		for (i = lo; i < hi; i++) {
+			qi_add(aclp, qp, pci_qindex.qi_by_vid[i], ents, max,
+				countp);
+		}
+	} else if (mask != 0 && (rest & (rest + 1)) == 0) {
+		/* Base class, base/subclass or the full class: a range of
+		 * the class index.
+		 */
+		lo = qi_class_bound(want);
+		hi = qi_class_bound(want + rest + 1);
+		for (i = lo; i < hi; i++) {
+			qi_add(aclp, qp, pci_qindex.qi_by_class[i], ents, max,
+				countp);
+		}
+	} else {
+		/* Any other mask: compare every class. The first loop has no
+		 * branches so the compiler can vectorize it.
+		 */
+		cls = pci_qindex.qi_class;
+		hit = pci_qindex.qi_hit;
+		n = nr_pcidev;
+		for (i = 0; i < n; i++)
+			hit[i] = (cls[i] & mask) == want;
+		for (i = 0; i < n; i++) {
+			if (hit[i])
+				qi_add(aclp, qp, i, ents, max, countp);
+		}
+	}
+	return OK;
 }
 
 /*===========================================================================*
  *				_pci_grant_access			     *
  *===========================================================================*/
 int _pci_grant_access(int devind, endpoint_t proc) {
-	int r = OK;
-	const int bar_nr = pcidev[devind].pd_bar_nr;
+	int r;
 	struct io_range ior;
 	struct minix_mem_range mr;
 
+	if ((r = pci_slot(devind, &devind)) != OK)
+		return r;
+	const int bar_nr = pcidev[devind].pd_bar_nr;
+
 	for (int i = 0; i < bar_nr; i++) {
-		const struct pci_bar *bar = &pcidev[devind].pd_bar[i];
+		const struct bar *bar = &pcidev[devind].pd_bar[i];
 
 		if (bar->pb_flags & PBF_INCOMPLETE) {
 			printf("pci_reserve_a: BAR %d is incomplete\n", i);
@@ -1996,8 +4860,18 @@ int _pci_grant_access(int devind, endpoint_t proc) {
 				r = -1;
 			}
 		} else {
-			mr.mr_base = bar->pb_base;
-			mr.mr_limit = mr.mr_base + bar->pb_size - 1;
+			/* A 64-bit BAR may lie beyond what phys_bytes can
+			 * describe on this platform; such a range cannot be
+			 * granted.
+			 */
+			if (bar->pb_base + bar->pb_size - 1 > (phys_bytes)~0) {
+				printf("pci_reserve_a: BAR %d at 0x%llx is not addressable\n",
+					i, (unsigned long long)bar->pb_base);
+				r = -1;
+				continue;
+			}
+			mr.mr_base = (phys_bytes)bar->pb_base;
+			mr.mr_limit = mr.mr_base + (phys_bytes)bar->pb_size - 1;
 
 			if (sys_privctl(proc, SYS_PRIV_ADD_MEM, &mr) != OK) {
 				printf("sys_privctl failed for proc %d (MEM): %d\n", proc, r);
@@ -2023,17 +4897,19 @@ int _pci_grant_access(int devind, endpoint_t proc) {
  *===========================================================================*/
 int _pci_reserve(int devind, endpoint_t proc, struct rs_pci *aclp)
 {
-    if (devind < 0 || devind >= nr_pcidev)
-        return EINVAL;
+    int slot, r;
+
+    if ((r = pci_slot(devind, &slot)) != OK)
+        return r;
 
-    if (!visible(aclp, devind))
+    if (!visible(aclp, slot))
         return EPERM;
 
-    if (pcidev[devind].pd_inuse && pcidev[devind].pd_proc != proc)
+    if (pcidev[slot].pd_inuse && pcidev[slot].pd_proc != proc)
         return EBUSY;
 
-    pcidev[devind].pd_inuse = 1;
-    pcidev[devind].pd_proc = proc;
+    pcidev[slot].pd_inuse = 1;
+    pcidev[slot].pd_proc = proc;
 
     return _pci_grant_access(devind, proc);
 }
@@ -2054,13 +4930,15 @@ void _pci_release(endpoint_t proc) {
  *===========================================================================*/
 int _pci_ids(int devind, u16_t *vidp, u16_t *didp)
 {
+    int r;
+
     if (!vidp || !didp)
         return EINVAL;
-    if (devind < 0 || devind >= nr_pcidev)
-        return EINVAL;
+    if ((r = pci_slot(devind, &devind)) != OK)
+        return r;
 
-    *vidp = pcidev[devind].pd_vid;
-    *didp = pcidev[devind].pd_did;
+    *vidp = pciid[devind].pi_vid;
+    *didp = pciid[devind].pi_did;
     return OK;
 }
 
@@ -2069,20 +4947,61 @@ int _pci_ids(int devind, u16_t *vidp, u16_t *didp)
  *===========================================================================*/
 void _pci_rescan_bus(u8_t busnr)
 {
-	int busind = get_busind(busnr);
-	if (busind < 0) {
-		return;
-	}
+	int busind, devind, next;
+	u32_t v;
 
-	if (probe_bus(busind) != 0) {
+	busind = get_busind(busnr);
+	if (busind < 0) {
 		return;
 	}
 
-	if (complete_bridges() != 0) {
-		return;
+	/* Compare the bus with what we know. Functions that no longer
+	 * answer with the same IDs are retired; probe_func skips the ones
+	 * that are still there, so only new functions are read, sized and
+	 * given resources.
+	 */
+	for (devind = pcibus[busind].pb_first_dev; devind >= 0; devind = next) {
+		next = pcidev[devind].pd_next;
+		shadow_inval(devind, PCI_VID, 4);
+		v = __pci_attr_r32(devind, PCI_VID);
+		if ((v & 0xffff) != pciid[devind].pi_vid ||
+			(v >> 16) != pciid[devind].pi_did) {
+			pci_del_dev(devind);
+		}
 	}
 
+	probe_bus(busind);
+	pci_enum_buses(busind);
+	complete_bridges();
 	complete_bars();
+	acl_refresh();
+	pci_qindex_update();
+	pcii_unselect();
+}
+
+/*===========================================================================*
+ *				_pci_del_dev				     *
+ *===========================================================================*/
+int _pci_del_dev(int devind)
+{
+	u16_t cr;
+	int r;
+
+	/* Retire a device, for instance before it is hot-unplugged. Its
+	 * decoders are switched off first in case it is still there.
+	 */
+	if ((r = pci_slot(devind, &devind)) != OK)
+		return r;
+
+	cr = __pci_attr_r16(devind, PCI_CR);
+	__pci_attr_w16(devind, PCI_CR,
+		cr & ~(PCI_CR_IO_EN | PCI_CR_MEM_EN | PCI_CR_MAST_EN));
+
+	pci_del_dev(devind);
+	acl_refresh();
+	pci_qindex_update();
+	pcii_unselect();
+	return OK;
 }
 
 /*===========================================================================*
@@ -2093,27 +5012,28 @@ int _pci_slot_name(int devind, char **cpp)
     static char label[16];
     char *p = label;
     char *end = label + sizeof(label) - 1;
+    int r;
 
     if (cpp == NULL)
         return EINVAL;
 
-    if (devind < 0 || devind >= nr_pcidev)
-        return EINVAL;
+    if ((r = pci_slot(devind, &devind)) != OK)
+        return r;
 
     /* Compose: domain (always 0), busnr, dev, func */
-    if (ntostr(0, &p, end) != 0) return EINVAL;
+    ntostr(0, &p, end);
     if (p >= end) return EINVAL;
     *p++ = '.';
 
-    if (ntostr(pcidev[devind].pd_busnr, &p, end) != 0) return EINVAL;
+    ntostr(pciid[devind].pi_busnr, &p, end);
     if (p >= end) return EINVAL;
     *p++ = '.';
 
-    if (ntostr(pcidev[devind].pd_dev, &p, end) != 0) return EINVAL;
+    ntostr(pciid[devind].pi_dev, &p, end);
     if (p >= end) return EINVAL;
     *p++ = '.';
 
-    if (ntostr(pcidev[devind].pd_func, &p, end) != 0) return EINVAL;
+    ntostr(pciid[devind].pi_func, &p, end);
     *p = '\0';
 
     *cpp = label;
@@ -2136,19 +5056,22 @@ _pci_dev_name(u16_t vid, u16_t did)
 
 
 /*===========================================================================*
- *				_pci_get_bar				     *
+ *				_pci_get_bar64				     *
  *===========================================================================*/
-int _pci_get_bar(int devind, int port, u32_t *base, u32_t *size, int *ioflag)
+int _pci_get_bar64(int devind, int port, u64_t *base, u64_t *size,
+    int *ioflag)
 {
+    int r;
+
     if (!base || !size || !ioflag)
         return EINVAL;
 
-    if (devind < 0 || devind >= nr_pcidev)
-        return EINVAL;
+    if ((r = pci_slot(devind, &devind)) != OK)
+        return r;
 
-    const struct pci_dev *pdev = &pcidev[devind];
+    const struct pcidev *pdev = &pcidev[devind];
     for (int i = 0; i < pdev->pd_bar_nr; i++) {
-        const struct pci_bar *bar = &pdev->pd_bar[i];
+        const struct bar *bar = &pdev->pd_bar[i];
         int reg = PCI_BAR + 4 * bar->pb_nr;
 
         if (reg != port)
@@ -2166,19 +5089,67 @@ int _pci_get_bar(int devind, int port, u32_t *base, u32_t *size, int *ioflag)
     return EINVAL;
 }
 
+/*===========================================================================*
+ *				_pci_get_bar				     *
+ *===========================================================================*/
+int _pci_get_bar(int devind, int port, u32_t *base, u32_t *size, int *ioflag)
+{
+    u64_t base64, size64;
+    int r;
+
+    if (!base || !size || !ioflag)
+        return EINVAL;
+
+    r = _pci_get_bar64(devind, port, &base64, &size64, ioflag);
+    if (r != OK)
+        return r;
+
+    /* Callers of the 32-bit interface cannot use a BAR above 4 GB */
+    if (base64 + size64 - 1 > 0xffffffffU)
+        return EFBIG;
+
+    *base = (u32_t)base64;
+    *size = (u32_t)size64;
+    return OK;
+}
+
+/*===========================================================================*
+ *				check_port				     *
+ *===========================================================================*/
+static int check_port(int devind, int port, int width)
+{
+	int busind;
+
+	if (pciid[devind].pi_flags & PIF_GONE)
+		return ENODEV;
+	if (port < 0 || port + width > PCI_EXT_CFG_SIZE)
+		return EINVAL;
+	if (port + width <= PCI_CFG_SIZE)
+		return OK;
+
+	/* Extended configuration space needs a backend that can reach it. */
+	busind = get_busind(pciid[devind].pi_busnr);
+	if (busind < 0 || port + width > pcibus[busind].pb_cfgsize)
+		return ENOTSUP;
+	return OK;
+}
+
 /*===========================================================================*
  *				_pci_attr_r8				     *
  *===========================================================================*/
 int _pci_attr_r8(int devind, int port, u8_t *vp)
 {
+    int r;
+
     if (!vp)
         return EINVAL;
-    if (devind < 0 || devind >= nr_pcidev)
-        return EINVAL;
-    if (port < 0 || port >= 256)
-        return EINVAL;
+    if ((r = pci_slot(devind, &devind)) != OK)
+        return r;
+    if ((r = check_port(devind, port, 1)) != OK)
+        return r;
 
     *vp = __pci_attr_r8(devind, port);
+    pcii_unselect();
     return OK;
 }
 
@@ -2187,16 +5158,19 @@ int _pci_attr_r8(int devind, int port, u8_t *vp)
  *===========================================================================*/
 int _pci_attr_r16(int devind, int port, u16_t *vp)
 {
+    int r;
+
     if (vp == NULL)
         return EINVAL;
 
-    if (devind < 0 || devind >= nr_pcidev)
-        return EINVAL;
+    if ((r = pci_slot(devind, &devind)) != OK)
+        return r;
 
-    if (port < 0 || port > 254)
-        return EINVAL;
+    if ((r = check_port(devind, port, 2)) != OK)
+        return r;
 
     *vp = __pci_attr_r16(devind, port);
+    pcii_unselect();
     return OK;
 }
 
@@ -2205,14 +5179,17 @@ int _pci_attr_r16(int devind, int port, u16_t *vp)
  *===========================================================================*/
 int _pci_attr_r32(int devind, int port, u32_t *vp)
 {
+    int r;
+
     if (vp == NULL)
         return EINVAL;
-    if (devind < 0 || devind >= nr_pcidev)
-        return EINVAL;
-    if (port < 0 || port > 252)
-        return EINVAL;
+    if ((r = pci_slot(devind, &devind)) != OK)
+        return r;
+    if ((r = check_port(devind, port, 4)) != OK)
+        return r;
 
     *vp = __pci_attr_r32(devind, port);
+    pcii_unselect();
     return OK;
 }
 
@@ -2221,12 +5198,15 @@ int _pci_attr_r32(int devind, int port, u32_t *vp)
  *===========================================================================*/
 int _pci_attr_w8(int devind, int port, u8_t value)
 {
-    if (devind < 0 || devind >= nr_pcidev)
-        return EINVAL;
-    if (port < 0 || port >= 256)
-        return EINVAL;
+    int r;
+
+    if ((r = pci_slot(devind, &devind)) != OK)
+        return r;
+    if ((r = check_port(devind, port, 1)) != OK)
+        return r;
 
     __pci_attr_w8(devind, port, value);
+    pcii_unselect();
     return OK;
 }
 
@@ -2235,11 +5215,14 @@ int _pci_attr_w8(int devind, int port, u8_t value)
  *===========================================================================*/
 int _pci_attr_w16(int devind, int port, u16_t value)
 {
-	if (devind < 0 || devind >= nr_pcidev)
-		return EINVAL;
-	if (port < 0 || port > 254)
-		return EINVAL;
+	int r;
+
+	if ((r = pci_slot(devind, &devind)) != OK)
+		return r;
+	if ((r = check_port(devind, port, 2)) != OK)
+		return r;
 	__pci_attr_w16(devind, port, value);
+	pcii_unselect();
 	return OK;
 }
 
@@ -2248,11 +5231,92 @@ int _pci_attr_w16(int devind, int port, u16_t value)
  *===========================================================================*/
 int _pci_attr_w32(int devind, int port, u32_t value)
 {
-	if (devind < 0 || devind >= nr_pcidev)
-		return EINVAL;
-	if (port < 0 || port > 252)
-		return EINVAL;
+	int r;
+
+	if ((r = pci_slot(devind, &devind)) != OK)
+		return r;
+	if ((r = check_port(devind, port, 4)) != OK)
+		return r;
 
 	__pci_attr_w32(devind, port, value);
+	pcii_unselect();
+	return OK;
+}
+
+/*===========================================================================*
+ *				_pci_get_stats				     *
+ *===========================================================================*/
+int _pci_get_stats(int devind, unsigned long *readsp, unsigned long *writesp)
+{
+	/* Debugging only, see PCI_STATS */
+#if PCI_STATS
+	int r;
+
+	if (readsp == NULL || writesp == NULL)
+		return EINVAL;
+	if ((r = pci_slot(devind, &devind)) != OK)
+		return r;
+
+	*readsp = pcidev[devind].pd_stat.ps_reads;
+	*writesp = pcidev[devind].pd_stat.ps_writes;
 	return OK;
+#else
+	(void)devind;
+	(void)readsp;
+	(void)writesp;
+	return ENOSYS;
+#endif
+}
+
+/*===========================================================================*
+ *				_pci_dump_stats				     *
+ *===========================================================================*/
+void _pci_dump_stats(void)
+{
+#if PCI_STATS
+	static const char *width_name[3] = { "8-bit", "16-bit", "32-bit" };
+	int i;
+
+	printf("PCI: %lu kernel calls, %lu failed, %lu shadow hits\n",
+		pci_stats.st_kcalls, pci_stats.st_kfails,
+		pci_stats.st_shadow_hits);
+	printf("PCI: status register: %lu reads, %lu writes\n",
+		pci_stats.st_sts.ps_reads, pci_stats.st_sts.ps_writes);
+
+	for (i = 0; i < 3; i++) {
+		printf("PCI: %s: %lu reads, %lu writes\n", width_name[i],
+			pci_stats.st_width[i].ps_reads,
+			pci_stats.st_width[i].ps_writes);
+	}
+
+	for (i = 0; i < nr_pcibus; i++) {
+		printf("PCI: bus %d (index %d): %lu reads, %lu writes\n",
+			pcibus[i].pb_busnr, i, pcibus[i].pb_stat.ps_reads,
+			pcibus[i].pb_stat.ps_writes);
+	}
+
+	for (i = 0; i < nr_pcidev; i++) {
+		if (pcidev[i].pd_stat.ps_reads == 0 &&
+		    pcidev[i].pd_stat.ps_writes == 0)
+			continue;
+		printf("PCI: %d.%d.%d (devind %d, owner %d): "
+			"%lu reads, %lu writes\n",
+			pciid[i].pi_busnr, pciid[i].pi_dev,
+			pciid[i].pi_func, i,
+			pcidev[i].pd_inuse ? pcidev[i].pd_proc : NONE,
+			pcidev[i].pd_stat.ps_reads,
+			pcidev[i].pd_stat.ps_writes);
+	}
+
+	for (i = 0; i < PCI_EXT_CFG_SIZE / 4; i++) {
+		if (pci_stats.st_reg[i].ps_reads == 0 &&
+		    pci_stats.st_reg[i].ps_writes == 0)
+			continue;
+		printf("PCI: register 0x%03x: %lu reads, %lu writes\n",
+			i * 4, pci_stats.st_reg[i].ps_reads,
+			pci_stats.st_reg[i].ps_writes);
+	}
+#else
+	printf("PCI: configuration access statistics not compiled in\n");
+#endif
 }
@@ -0,0 +1,53 @@
+/*
+pci_query.h
+
+Bulk device queries: cursor based iteration over the devices a driver's
+ACL makes visible, and lookups by any combination of IDs and class,
+returning several devices per call.
+*/
+#ifndef PCI_QUERY_H
+#define PCI_QUERY_H
+
+#include <sys/types.h>
+
+/* One device in a reply. Class is base class << 16 | subclass << 8 |
+ * programming interface, as in rs_pci_class.
+ */
+struct pci_dev_ent
+{
+	int pde_devind;
+	u16_t pde_vid;
+	u16_t pde_did;
+	u32_t pde_class;
+};
+
+/* Opaque iteration state. Start with PCI_CURSOR_INIT; the driver should
+ * not interpret the value otherwise.
+ */
+typedef u64_t pci_cursor_t;
+#define PCI_CURSOR_INIT	((pci_cursor_t)0)
+
+int _pci_iter_dev(struct rs_pci *aclp, pci_cursor_t *cursorp,
+	struct pci_dev_ent *ents, int max, int *countp);
+
+/* Query by identity and class. Every ID field set to PCI_QUERY_ANY is
+ * ignored; a device matches the class if (class & pq_class_mask) ==
+ * (pq_class & pq_class_mask), so a zero mask matches every class. Only
+ * the low 24 bits of pq_class and pq_class_mask are used.
+ */
+#define PCI_QUERY_ANY	0xffff
+
+struct pci_query
+{
+	u16_t pq_vid;
+	u16_t pq_did;
+	u16_t pq_sub_vid;
+	u16_t pq_sub_did;
+	u32_t pq_class;
+	u32_t pq_class_mask;
+};
+
+int _pci_query_dev(struct rs_pci *aclp, const struct pci_query *qp,
+	struct pci_dev_ent *ents, int max, int *countp);
+
+#endif /* PCI_QUERY_H */
@@ -0,0 +1,757 @@
+/*
+pci_sim.c
+
+Simulated PCI configuration space. Functions, bridges, BAR size masks and
+capability chains are described in a topology file and kept in memory;
+the pcibus accessors of pci.c call pcisim_read/pcisim_write instead of
+doing port or ECAM I/O when the driver is built with PCI_SIM.
+
+Topology file format, one directive per line, '#' starts a comment.
+Numbers are C style (0x prefix for hex), bus, device and function
+numbers included, so "fn 16:0.0" and "busnr 0 16 16" name the same bus.
+IDs and classes are always hex, without the prefix, as lspci prints
+them. Directives after a "fn" line apply to that function:
+
+	memhigh <addr>				top of RAM for complete_bars
+	window mem|io <base> <size>		host bridge window (_CRS)
+	fn <bus>:<dev>.<func> <vid>:<did> <class> [bridge|cardbus] [multi]
+	sub <sub_vid>:<sub_did>
+	bar <nr> io|mem|mem64 [pref] <size> [<base>]
+	busnr <primary> <secondary> <subordinate>
+	cap <id> <offset> [<dword> ...]		standard capability
+	ecap <id> <offset> [<dword> ...]	extended capability
+	reg <offset> <value> [<writemask>]	raw configuration dword
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pci_sim.h"
+
+#define SIM_DWORDS	(PCISIM_CFG_SIZE / 4)
+#define SIM_LINE_MAX	256
+#define SIM_MAX_ARGS	32
+
+#define SIM_MEM_HIGH	0x08000000	/* top of RAM unless "memhigh" */
+
+#define SIM_DEVFN(dev, func)	(((dev) << 3) | (func))
+
+/* Status bits that are cleared by writing one */
+#define SIM_STS_W1C	0xf9000000
+
+struct pcisim_fn
+{
+	int sf_busnr;
+	int sf_devfn;
+	int sf_headt;
+	int sf_lastcap;		/* offset of the last capability, or 0 */
+	int sf_lastecap;	/* same for extended capabilities */
+	uint32_t sf_cfg[SIM_DWORDS];
+	uint32_t sf_wmask[SIM_DWORDS];
+};
+
+static struct pcisim_fn **sim_fn;
+static int sim_nr_fn, sim_alloc_fn;
+static int *sim_index[256];	/* per bus: devfn -> index in sim_fn */
+static uint32_t sim_mem_high= SIM_MEM_HIGH;
+static int sim_loaded= 0;
+static struct pcisim_stats sim_stats;
+
+static struct
+{
+	int sw_io;
+	uint64_t sw_base;
+	uint64_t sw_size;
+} sim_window[PCISIM_NR_WINDOW];
+static int sim_nr_window;
+
+static struct pcisim_fn *sim_lookup(int busnr, int devfn)
+{
+	int i;
+
+	if (busnr < 0 || busnr > 255 || sim_index[busnr] == NULL)
+		return NULL;
+	i = sim_index[busnr][devfn];
+	return i < 0 ? NULL : sim_fn[i];
+}
+
+static uint32_t sim_w1c(const struct pcisim_fn *fn, int dw)
+{
+	if (dw == 1)
+		return SIM_STS_W1C;
+	if ((fn->sf_headt & 0x7f) == 1 && dw == 7)
+		return SIM_STS_W1C;	/* secondary status */
+	if ((fn->sf_headt & 0x7f) == 2 && dw == 5)
+		return SIM_STS_W1C;	/* CardBus secondary status */
+	return 0;
+}
+
+/*===========================================================================*
+ *				pcisim_reset				     *
+ *===========================================================================*/
+void pcisim_reset(void)
+{
+	int i;
+
+	for (i = 0; i < sim_nr_fn; i++)
+		free(sim_fn[i]);
+	free(sim_fn);
+	sim_fn = NULL;
+	sim_nr_fn = sim_alloc_fn = 0;
+
+	for (i = 0; i < 256; i++) {
+		free(sim_index[i]);
+		sim_index[i] = NULL;
+	}
+	sim_loaded = 0;
+	sim_nr_window = 0;
+	sim_mem_high = SIM_MEM_HIGH;
+	memset(&sim_stats, 0, sizeof(sim_stats));
+}
+
+/*===========================================================================*
+ *				pcisim_add_fn				     *
+ *===========================================================================*/
+struct pcisim_fn *pcisim_add_fn(int busnr, int dev, int func, uint16_t vid,
+	uint16_t did, uint32_t class, int headt)
+{
+	struct pcisim_fn *fn, **nfn;
+	int i, devfn;
+
+	/* With ARI a function number can exceed 7; dev/func are then just
+	 * the upper and lower bits of the 8-bit function number.
+	 */
+	devfn = SIM_DEVFN(dev, func);
+	if (busnr < 0 || busnr > 255 || devfn < 0 || devfn > 255)
+		return NULL;
+
+	if (sim_index[busnr] == NULL) {
+		sim_index[busnr] = malloc(256 * sizeof(int));
+		if (sim_index[busnr] == NULL)
+			return NULL;
+		for (i = 0; i < 256; i++)
+			sim_index[busnr][i] = -1;
+	}
+	if (sim_index[busnr][devfn] >= 0)
+		return NULL;
+
+	if (sim_nr_fn == sim_alloc_fn) {
+		i = sim_alloc_fn ? 2 * sim_alloc_fn : 64;
+		nfn = realloc(sim_fn, i * sizeof(*sim_fn));
+		if (nfn == NULL)
+			return NULL;
+		sim_fn = nfn;
+		sim_alloc_fn = i;
+	}
+
+	fn = calloc(1, sizeof(*fn));
+	if (fn == NULL)
+		return NULL;
+	fn->sf_busnr = busnr;
+	fn->sf_devfn = devfn;
+	fn->sf_headt = headt;
+
+	fn->sf_cfg[0] = vid | ((uint32_t)did << 16);
+	fn->sf_cfg[2] = class << 8;
+	fn->sf_cfg[3] = (uint32_t)headt << 16;
+
+	fn->sf_wmask[1] = 0x0000ffff;	/* command */
+	fn->sf_wmask[3] = 0x0000ffff;	/* cache line size, latency timer */
+	fn->sf_wmask[15] = 0x000000ff;	/* interrupt line */
+	switch (headt & 0x7f) {
+	case 1:
+		fn->sf_wmask[6] = 0xffffffff;	/* bus numbers */
+		fn->sf_wmask[7] = 0x0000f0f0;	/* I/O base/limit */
+		fn->sf_wmask[8] = 0xfff0fff0;	/* memory base/limit */
+		fn->sf_wmask[9] = 0xfff0fff0;	/* prefetchable base/limit */
+		fn->sf_wmask[10] = 0xffffffff;
+		fn->sf_wmask[11] = 0xffffffff;
+		fn->sf_wmask[12] = 0xffffffff;	/* I/O upper 16 bits */
+		fn->sf_wmask[15] |= 0xffff0000;	/* bridge control */
+		break;
+	case 2:
+		fn->sf_wmask[6] = 0xffffffff;	/* bus numbers */
+		for (i = 7; i <= 14; i++)
+			fn->sf_wmask[i] = 0xfffffffc;	/* windows */
+		fn->sf_wmask[15] |= 0xffff0000;	/* bridge control */
+		break;
+	}
+
+	/* Device specific space is plain read/write memory. */
+	for (i = 0x40 / 4; i < SIM_DWORDS; i++)
+		fn->sf_wmask[i] = 0xffffffff;
+
+	sim_index[busnr][devfn] = sim_nr_fn;
+	sim_fn[sim_nr_fn++] = fn;
+	sim_loaded = 1;
+	return fn;
+}
+
+/*===========================================================================*
+ *				pcisim_set_sub				     *
+ *===========================================================================*/
+void pcisim_set_sub(struct pcisim_fn *fn, uint16_t sub_vid, uint16_t sub_did)
+{
+	fn->sf_cfg[0x2c / 4] = sub_vid | ((uint32_t)sub_did << 16);
+}
+
+/*===========================================================================*
+ *				pcisim_set_bar				     *
+ *===========================================================================*/
+void pcisim_set_bar(struct pcisim_fn *fn, int bar_nr, int type,
+	uint64_t size, uint64_t base)
+{
+	int dw = 0x10 / 4 + bar_nr;
+	uint64_t mask = ~(size - 1);
+	uint32_t flags;
+
+	switch (type & ~PCISIM_BAR_PREF) {
+	case PCISIM_BAR_IO:
+		fn->sf_wmask[dw] = (uint32_t)mask & 0xfffffffc;
+		fn->sf_cfg[dw] = ((uint32_t)base & fn->sf_wmask[dw]) | 1;
+		return;
+	case PCISIM_BAR_MEM:
+		flags = 0;
+		break;
+	case PCISIM_BAR_MEM64:
+		flags = 0x4;
+		break;
+	default:
+		return;
+	}
+	if (type & PCISIM_BAR_PREF)
+		flags |= 0x8;
+
+	fn->sf_wmask[dw] = (uint32_t)mask & 0xfffffff0;
+	fn->sf_cfg[dw] = ((uint32_t)base & fn->sf_wmask[dw]) | flags;
+	if ((type & ~PCISIM_BAR_PREF) == PCISIM_BAR_MEM64) {
+		fn->sf_wmask[dw + 1] = (uint32_t)(mask >> 32);
+		fn->sf_cfg[dw + 1] = (uint32_t)(base >> 32);
+	}
+}
+
+/*===========================================================================*
+ *				pcisim_set_busnr			     *
+ *===========================================================================*/
+void pcisim_set_busnr(struct pcisim_fn *fn, int prim, int sec, int subord)
+{
+	fn->sf_cfg[0x18 / 4] = (fn->sf_cfg[0x18 / 4] & 0xff000000) |
+		(prim & 0xff) | ((sec & 0xff) << 8) | ((subord & 0xff) << 16);
+}
+
+/*===========================================================================*
+ *				pcisim_add_cap				     *
+ *===========================================================================*/
+void pcisim_add_cap(struct pcisim_fn *fn, int id, int offset,
+	const uint32_t *body, int nr_dwords)
+{
+	int i, dw;
+
+	if (offset < 0x40 || offset > 0xfc || (offset & 3))
+		return;
+	dw = offset / 4;
+	for (i = 0; i < nr_dwords && dw + i < 0x100 / 4; i++)
+		fn->sf_cfg[dw + i] = body[i];
+
+	/* ID and next pointer are read-only. */
+	fn->sf_cfg[dw] = (fn->sf_cfg[dw] & 0xffff0000) | (id & 0xff);
+	fn->sf_wmask[dw] = 0xffff0000;
+
+	if (fn->sf_lastcap == 0) {
+		fn->sf_cfg[0x34 / 4] = offset;
+		fn->sf_cfg[1] |= 0x00100000;	/* capability list */
+	} else {
+		fn->sf_cfg[fn->sf_lastcap / 4] |= (uint32_t)offset << 8;
+	}
+	fn->sf_lastcap = offset;
+}
+
+/*===========================================================================*
+ *				pcisim_add_ecap				     *
+ *===========================================================================*/
+void pcisim_add_ecap(struct pcisim_fn *fn, int id, int offset,
+	const uint32_t *body, int nr_dwords)
+{
+	int i, dw;
+
+	if (offset < 0x100 || offset >= PCISIM_CFG_SIZE || (offset & 3))
+		return;
+	dw = offset / 4;
+	for (i = 0; i < nr_dwords && dw + i < SIM_DWORDS; i++)
+		fn->sf_cfg[dw + i] = body[i];
+
+	/* Header: ID, version 1, next offset filled in by the next ecap. */
+	fn->sf_cfg[dw] = (id & 0xffff) | (1 << 16);
+	fn->sf_wmask[dw] = 0;
+
+	if (fn->sf_lastecap != 0)
+		fn->sf_cfg[fn->sf_lastecap / 4] |= (uint32_t)offset << 20;
+	fn->sf_lastecap = offset;
+}
+
+/*===========================================================================*
+ *				pcisim_set_reg				     *
+ *===========================================================================*/
+void pcisim_set_reg(struct pcisim_fn *fn, int offset, uint32_t value,
+	uint32_t wmask)
+{
+	if (offset < 0 || offset >= PCISIM_CFG_SIZE)
+		return;
+	fn->sf_cfg[offset / 4] = value;
+	fn->sf_wmask[offset / 4] = wmask;
+}
+
+/*===========================================================================*
+ *				pcisim_read				     *
+ *===========================================================================*/
+uint32_t pcisim_read(int busnr, int dev, int func, int port, int width)
+{
+	struct pcisim_fn *fn;
+	uint32_t v;
+
+	sim_stats.ps_reads++;
+	fn = sim_lookup(busnr, SIM_DEVFN(dev, func));
+	if (fn == NULL || port < 0 || port + width > PCISIM_CFG_SIZE) {
+		sim_stats.ps_absent++;
+		return width == 4 ? 0xffffffff : (1U << (8 * width)) - 1;
+	}
+
+	v = fn->sf_cfg[port / 4] >> (8 * (port & 3));
+	return width == 4 ? v : v & ((1U << (8 * width)) - 1);
+}
+
+/*===========================================================================*
+ *				pcisim_write				     *
+ *===========================================================================*/
+void pcisim_write(int busnr, int dev, int func, int port, int width,
+	uint32_t value)
+{
+	struct pcisim_fn *fn;
+	uint32_t be, wm, clr, *p;
+	int dw;
+
+	sim_stats.ps_writes++;
+	fn = sim_lookup(busnr, SIM_DEVFN(dev, func));
+	if (fn == NULL || port < 0 || port + width > PCISIM_CFG_SIZE) {
+		sim_stats.ps_absent++;
+		return;
+	}
+
+	dw = port / 4;
+	be = width == 4 ? 0xffffffff :
+		((1U << (8 * width)) - 1) << (8 * (port & 3));
+	value <<= 8 * (port & 3);
+
+	p = &fn->sf_cfg[dw];
+	wm = fn->sf_wmask[dw] & be;
+	clr = value & be & sim_w1c(fn, dw);
+	*p = ((*p & ~wm) | (value & wm)) & ~clr;
+}
+
+/*===========================================================================*
+ *			topology file parser				     *
+ *===========================================================================*/
+static int split(char *line, char **argv)
+{
+	int argc = 0;
+	char *p;
+
+	if ((p = strchr(line, '#')) != NULL)
+		*p = '\0';
+
+	for (p = strtok(line, " \t\r\n"); p != NULL && argc < SIM_MAX_ARGS;
+	    p = strtok(NULL, " \t\r\n")) {
+		argv[argc++] = p;
+	}
+	return argc;
+}
+
+static int parse_bdf(const char *s, unsigned int *busp, unsigned int *devp,
+	unsigned int *funcp)
+{
+	char *end;
+
+	/* <bus>:<dev>.<func>, each a C style number like everywhere else */
+	*busp = strtoul(s, &end, 0);
+	if (end == s || *end != ':')
+		return -1;
+	s = end + 1;
+	*devp = strtoul(s, &end, 0);
+	if (end == s || *end != '.')
+		return -1;
+	s = end + 1;
+	*funcp = strtoul(s, &end, 0);
+	if (end == s || *end != '\0')
+		return -1;
+	return 0;
+}
+
+static int parse_fn(int argc, char **argv, struct pcisim_fn **fnp)
+{
+	unsigned int bus, dev, func, vid, did;
+	unsigned long class;
+	int i, headt = 0;
+
+	if (argc < 4 ||
+	    parse_bdf(argv[1], &bus, &dev, &func) != 0 ||
+	    sscanf(argv[2], "%x:%x", &vid, &did) != 2)
+		return -1;
+	class = strtoul(argv[3], NULL, 16);
+
+	for (i = 4; i < argc; i++) {
+		if (strcmp(argv[i], "bridge") == 0)
+			headt = (headt & 0x80) | 1;
+		else if (strcmp(argv[i], "cardbus") == 0)
+			headt = (headt & 0x80) | 2;
+		else if (strcmp(argv[i], "multi") == 0)
+			headt |= 0x80;
+		else
+			return -1;
+	}
+
+	*fnp = pcisim_add_fn(bus, dev, func, vid, did, class, headt);
+	return *fnp == NULL ? -1 : 0;
+}
+
+static int parse_bar(int argc, char **argv, struct pcisim_fn *fn)
+{
+	int i = 2, nr, type;
+
+	if (argc < 4)
+		return -1;
+	nr = strtol(argv[1], NULL, 0);
+	if (strcmp(argv[i], "io") == 0)
+		type = PCISIM_BAR_IO;
+	else if (strcmp(argv[i], "mem") == 0)
+		type = PCISIM_BAR_MEM;
+	else if (strcmp(argv[i], "mem64") == 0)
+		type = PCISIM_BAR_MEM64;
+	else
+		return -1;
+	i++;
+	if (strcmp(argv[i], "pref") == 0) {
+		if (type == PCISIM_BAR_IO)
+			return -1;
+		type |= PCISIM_BAR_PREF;
+		i++;
+	}
+	if (i >= argc || nr < 0 || nr > 5 ||
+	    (nr == 5 && (type & ~PCISIM_BAR_PREF) == PCISIM_BAR_MEM64))
+		return -1;
+
+	pcisim_set_bar(fn, nr, type, strtoull(argv[i], NULL, 0),
+		i + 1 < argc ? strtoull(argv[i + 1], NULL, 0) : 0);
+	return 0;
+}
+
+static int parse_window(int argc, char **argv)
+{
+	int io;
+
+	if (argc != 4)
+		return -1;
+	if (strcmp(argv[1], "io") == 0)
+		io = 1;
+	else if (strcmp(argv[1], "mem") == 0)
+		io = 0;
+	else
+		return -1;
+	return pcisim_add_window(io, strtoull(argv[2], NULL, 0),
+		strtoull(argv[3], NULL, 0));
+}
+
+static int parse_cap(int argc, char **argv, struct pcisim_fn *fn, int ext)
+{
+	uint32_t body[SIM_MAX_ARGS];
+	int i;
+
+	if (argc < 3)
+		return -1;
+	for (i = 3; i < argc; i++)
+		body[i - 3] = strtoul(argv[i], NULL, 0);
+
+	if (ext) {
+		pcisim_add_ecap(fn, strtol(argv[1], NULL, 0),
+			strtol(argv[2], NULL, 0), body, argc - 3);
+	} else {
+		pcisim_add_cap(fn, strtol(argv[1], NULL, 0),
+			strtol(argv[2], NULL, 0), body, argc - 3);
+	}
+	return 0;
+}
+
+/*===========================================================================*
+ *				pcisim_load				     *
+ *===========================================================================*/
+int pcisim_load(const char *path)
+{
+	char line[SIM_LINE_MAX], *argv[SIM_MAX_ARGS];
+	struct pcisim_fn *fn = NULL;
+	unsigned int sub_vid, sub_did;
+	int argc, lineno = 0, r;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "pcisim: cannot open %s\n", path);
+		return -1;
+	}
+
+	pcisim_reset();
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if ((argc = split(line, argv)) == 0)
+			continue;
+
+		if (strcmp(argv[0], "memhigh") == 0 && argc == 2) {
+			sim_mem_high = strtoul(argv[1], NULL, 0);
+			continue;
+		}
+		if (strcmp(argv[0], "window") == 0) {
+			r = parse_window(argc, argv);
+		} else if (strcmp(argv[0], "fn") == 0) {
+			r = parse_fn(argc, argv, &fn);
+		} else if (fn == NULL) {
+			r = -1;
+		} else if (strcmp(argv[0], "sub") == 0) {
+			r = (argc == 2 && sscanf(argv[1], "%x:%x", &sub_vid,
+				&sub_did) == 2) ? 0 : -1;
+			if (r == 0)
+				pcisim_set_sub(fn, sub_vid, sub_did);
+		} else if (strcmp(argv[0], "bar") == 0) {
+			r = parse_bar(argc, argv, fn);
+		} else if (strcmp(argv[0], "busnr") == 0 && argc == 4) {
+			pcisim_set_busnr(fn, strtol(argv[1], NULL, 0),
+				strtol(argv[2], NULL, 0),
+				strtol(argv[3], NULL, 0));
+			r = 0;
+		} else if (strcmp(argv[0], "cap") == 0) {
+			r = parse_cap(argc, argv, fn, 0);
+		} else if (strcmp(argv[0], "ecap") == 0) {
+			r = parse_cap(argc, argv, fn, 1);
+		} else if (strcmp(argv[0], "reg") == 0 &&
+		    (argc == 3 || argc == 4)) {
+			pcisim_set_reg(fn, strtol(argv[1], NULL, 0),
+				strtoul(argv[2], NULL, 0),
+				argc == 4 ? strtoul(argv[3], NULL, 0) : 0);
+			r = 0;
+		} else {
+			r = -1;
+		}
+
+		if (r != 0) {
+			fprintf(stderr, "pcisim: %s:%d: bad line\n", path,
+				lineno);
+			fclose(fp);
+			pcisim_reset();
+			return -1;
+		}
+	}
+
+	fclose(fp);
+	sim_loaded = 1;
+	return 0;
+}
+
+/*===========================================================================*
+ *				pcisim_update				     *
+ *===========================================================================*/
+int pcisim_update(const char *path)
+{
+	struct pcisim_fn **old_fn;
+	struct pcisim_stats stats;
+	int *old_index[256];
+	int i, j, old_nr, old_alloc;
+
+	/* Hot-plug: path describes the topology after the event. Functions
+	 * that are still there with the same IDs keep their configuration
+	 * space as the driver programmed it; the others appear or vanish.
+	 */
+	old_fn = sim_fn;
+	old_nr = sim_nr_fn;
+	old_alloc = sim_alloc_fn;
+	memcpy(old_index, sim_index, sizeof(old_index));
+	stats = sim_stats;
+
+	sim_fn = NULL;
+	sim_nr_fn = sim_alloc_fn = 0;
+	memset(sim_index, 0, sizeof(sim_index));
+	if (pcisim_load(path) != 0) {
+		sim_fn = old_fn;
+		sim_nr_fn = old_nr;
+		sim_alloc_fn = old_alloc;
+		memcpy(sim_index, old_index, sizeof(sim_index));
+		sim_stats = stats;
+		sim_loaded = 1;
+		return -1;
+	}
+	sim_stats = stats;
+
+	for (i = 0; i < sim_nr_fn; i++) {
+		if (old_index[sim_fn[i]->sf_busnr] == NULL)
+			continue;
+		j = old_index[sim_fn[i]->sf_busnr][sim_fn[i]->sf_devfn];
+		if (j >= 0 && old_fn[j]->sf_cfg[0] == sim_fn[i]->sf_cfg[0])
+			*sim_fn[i] = *old_fn[j];
+	}
+
+	for (i = 0; i < old_nr; i++)
+		free(old_fn[i]);
+	free(old_fn);
+	for (i = 0; i < 256; i++)
+		free(old_index[i]);
+	return 0;
+}
+
+/*===========================================================================*
+ *			synthetic topologies				     *
+ *===========================================================================*/
+static int gen_endpoint(int busnr, int dev, int func, int headt, int n)
+{
+	struct pcisim_fn *fn;
+
+	fn = pcisim_add_fn(busnr, dev, func, 0x8086, 0x1000 + (n & 0xfff),
+		0x020000, headt);
+	if (fn == NULL)
+		return 0;
+	pcisim_set_sub(fn, 0x8086, n & 0xffff);
+	pcisim_set_bar(fn, 0, PCISIM_BAR_MEM, 0x1000, 0);
+
+	/* Every bridge with I/O below it needs a 4 KB window; 64 KB of I/O
+	 * space only goes round if devices behind bridges do without.
+	 */
+	if (busnr == 0)
+		pcisim_set_bar(fn, 1, PCISIM_BAR_IO, 0x20, 0);
+	return 1;
+}
+
+static int gen_bridge(int busnr, int dev, int sec, int subord)
+{
+	struct pcisim_fn *fn;
+
+	fn = pcisim_add_fn(busnr, dev, 0, 0x8086, 0x244e, 0x060400, 1);
+	if (fn == NULL)
+		return 0;
+	pcisim_set_busnr(fn, busnr, sec, subord);
+	return 1;
+}
+
+/*===========================================================================*
+ *				pcisim_gen				     *
+ *===========================================================================*/
+int pcisim_gen(int kind, int max_fn, int max_bus)
+{
+	int n, bus, dev, func, l1, l2, sec;
+
+	/* Build one of the synthetic topologies, limited to max_fn functions
+	 * (host bridge and PCI bridges included) and max_bus buses. Returns
+	 * the number of functions created.
+	 */
+	pcisim_reset();
+	n = pcisim_add_fn(0, 0, 0, 0x8086, 0x1237, 0x060000, 0) != NULL;
+
+	switch (kind) {
+	case PCISIM_GEN_FLAT:
+		for (dev = 1; dev < 32 && n < max_fn; dev++)
+			n += gen_endpoint(0, dev, 0, 0, n);
+		break;
+	case PCISIM_GEN_CHAIN:
+		/* The host bridge is 0:0.0, so the first bridge is device 1 */
+		for (bus = 0; bus + 1 < max_bus && n + 2 <= max_fn; bus++) {
+			n += gen_bridge(bus, bus == 0, bus + 1, max_bus - 1);
+			n += gen_endpoint(bus + 1, 1, 0, 0, n);
+		}
+		break;
+	case PCISIM_GEN_FULL:
+		/* 15 bridges on bus 0, each with 16 bridges below it: 255
+		 * secondary buses. Endpoints are then spread round-robin over
+		 * the leaf buses until max_fn is reached.
+		 */
+		sec = 1;
+		for (l1 = 0; l1 < 15 && sec < max_bus && n < max_fn; l1++) {
+			bus = sec++;
+			n += gen_bridge(0, l1 + 1, bus, bus + 16);
+			for (l2 = 0; l2 < 16 && sec < max_bus && n < max_fn;
+			    l2++, sec++) {
+				n += gen_bridge(bus, l2, sec, sec);
+			}
+		}
+		for (dev = 0; dev < 32 && n < max_fn; dev++) {
+			for (bus = 2; bus < sec && n < max_fn; bus++) {
+				if ((bus - 1) % 17 == 0)
+					continue;	/* first-level bus */
+				n += gen_endpoint(bus, dev, 0, 0, n);
+			}
+		}
+		break;
+	case PCISIM_GEN_MULTIFN:
+		for (dev = 1; dev < 32 && n < max_fn; dev++) {
+			for (func = 0; func < 8 && n < max_fn; func++)
+				n += gen_endpoint(0, dev, func, 0x80, n);
+		}
+		break;
+	default:
+		return -1;
+	}
+	return n;
+}
+
+/*===========================================================================*
+ *				pcisim_add_window			     *
+ *===========================================================================*/
+int pcisim_add_window(int io, uint64_t base, uint64_t size)
+{
+	if (sim_nr_window == PCISIM_NR_WINDOW || size == 0)
+		return -1;
+	sim_window[sim_nr_window].sw_io = io;
+	sim_window[sim_nr_window].sw_base = base;
+	sim_window[sim_nr_window].sw_size = size;
+	sim_nr_window++;
+	return 0;
+}
+
+/*===========================================================================*
+ *				pcisim_get_window			     *
+ *===========================================================================*/
+int pcisim_get_window(int idx, int *iop, uint64_t *basep, uint64_t *sizep)
+{
+	if (idx < 0 || idx >= sim_nr_window)
+		return -1;
+	*iop = sim_window[idx].sw_io;
+	*basep = sim_window[idx].sw_base;
+	*sizep = sim_window[idx].sw_size;
+	return 0;
+}
+
+/*===========================================================================*
+ *				pcisim_active				     *
+ *===========================================================================*/
+int pcisim_active(void)
+{
+	return sim_loaded;
+}
+
+uint32_t pcisim_mem_high(void)
+{
+	return sim_mem_high;
+}
+
+void pcisim_set_mem_high(uint32_t mem_high)
+{
+	sim_mem_high = mem_high;
+}
+
+int pcisim_nr_fn(void)
+{
+	return sim_nr_fn;
+}
+
+void pcisim_get_stats(struct pcisim_stats *sp)
+{
+	*sp = sim_stats;
+}
+
+void pcisim_clear_stats(void)
+{
+	memset(&sim_stats, 0, sizeof(sim_stats));
+}
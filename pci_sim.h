@@ -0,0 +1,74 @@
+/*
+pci_sim.h
+
+In-memory configuration space used to run the enumerator without
+hardware. Only compiled in when PCI_SIM is defined.
+*/
+#ifndef PCI_SIM_H
+#define PCI_SIM_H
+
+#include <stdint.h>
+
+#define PCISIM_CFG_SIZE	4096	/* Every simulated function has PCIe space */
+
+/* BAR types for pcisim_set_bar */
+#define PCISIM_BAR_IO	1
+#define PCISIM_BAR_MEM	2
+#define PCISIM_BAR_MEM64 3
+#define PCISIM_BAR_PREF	0x10	/* or'ed into a memory type */
+
+struct pcisim_fn;
+
+struct pcisim_stats
+{
+	unsigned long ps_reads;
+	unsigned long ps_writes;
+	unsigned long ps_absent;	/* accesses to non-existent functions */
+};
+
+int pcisim_load(const char *path);
+int pcisim_update(const char *path);
+int pcisim_active(void);
+void pcisim_reset(void);
+
+uint32_t pcisim_read(int busnr, int dev, int func, int port, int width);
+void pcisim_write(int busnr, int dev, int func, int port, int width,
+	uint32_t value);
+
+/* Building a topology by hand; the loader and the benchmark generator
+ * both use these.
+ */
+struct pcisim_fn *pcisim_add_fn(int busnr, int dev, int func, uint16_t vid,
+	uint16_t did, uint32_t class, int headt);
+void pcisim_set_sub(struct pcisim_fn *fn, uint16_t sub_vid, uint16_t sub_did);
+void pcisim_set_bar(struct pcisim_fn *fn, int bar_nr, int type,
+	uint64_t size, uint64_t base);
+void pcisim_set_busnr(struct pcisim_fn *fn, int prim, int sec, int subord);
+void pcisim_add_cap(struct pcisim_fn *fn, int id, int offset,
+	const uint32_t *body, int nr_dwords);
+void pcisim_add_ecap(struct pcisim_fn *fn, int id, int offset,
+	const uint32_t *body, int nr_dwords);
+void pcisim_set_reg(struct pcisim_fn *fn, int offset, uint32_t value,
+	uint32_t wmask);
+
+/* Synthetic topologies for benchmarking, see pcisim_gen */
+#define PCISIM_GEN_FLAT		1	/* endpoints on bus 0 */
+#define PCISIM_GEN_CHAIN	2	/* bridge chain, one endpoint per bus */
+#define PCISIM_GEN_FULL		3	/* 256 buses behind two bridge levels */
+#define PCISIM_GEN_MULTIFN	4	/* 8-function devices on bus 0 */
+
+int pcisim_gen(int kind, int max_fn, int max_bus);
+
+/* Host bridge resource windows, standing in for ACPI _CRS */
+#define PCISIM_NR_WINDOW	16
+
+int pcisim_add_window(int io, uint64_t base, uint64_t size);
+int pcisim_get_window(int idx, int *iop, uint64_t *basep, uint64_t *sizep);
+
+uint32_t pcisim_mem_high(void);
+void pcisim_set_mem_high(uint32_t mem_high);
+int pcisim_nr_fn(void);
+void pcisim_get_stats(struct pcisim_stats *sp);
+void pcisim_clear_stats(void);
+
+#endif /* PCI_SIM_H */